@@ -42,75 +42,14 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <wchar.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 /* GNU / LibUSB */
 #include <libusb.h>
-#ifndef __ANDROID__
-#include <iconv.h>
-#endif
-
-#include "hidapi.h"
-
-#ifdef __ANDROID__
-
-/* Barrier implementation because Android/Bionic don't have pthread_barrier.
-   This implementation came from Brent Priddy and was posted on
-   StackOverflow. It is used with his permission. */
-typedef int pthread_barrierattr_t;
-typedef struct pthread_barrier {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int count;
-    int trip_count;
-} pthread_barrier_t;
-
-static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
-{
-	if(count == 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
-		return -1;
-	}
-	if(pthread_cond_init(&barrier->cond, 0) < 0) {
-		pthread_mutex_destroy(&barrier->mutex);
-		return -1;
-	}
-	barrier->trip_count = count;
-	barrier->count = 0;
-
-	return 0;
-}
-
-static int pthread_barrier_destroy(pthread_barrier_t *barrier)
-{
-	pthread_cond_destroy(&barrier->cond);
-	pthread_mutex_destroy(&barrier->mutex);
-	return 0;
-}
-
-static int pthread_barrier_wait(pthread_barrier_t *barrier)
-{
-	pthread_mutex_lock(&barrier->mutex);
-	++(barrier->count);
-	if(barrier->count >= barrier->trip_count)
-	{
-		barrier->count = 0;
-		pthread_cond_broadcast(&barrier->cond);
-		pthread_mutex_unlock(&barrier->mutex);
-		return 1;
-	}
-	else
-	{
-		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-		pthread_mutex_unlock(&barrier->mutex);
-		return 0;
-	}
-}
 
-#endif
+#include "hidapi_libusb.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -134,11 +73,26 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Number of input reports which are queued before the queue
+   policy starts discarding them. */
+#ifndef INPUT_REPORT_QUEUE_SIZE
+#define INPUT_REPORT_QUEUE_SIZE 32
+#endif
+
+/* String descriptors read through one device. String descriptor 0 is
+   fetched once and the chosen language remembered, and every decoded
+   string is kept, so asking for it again costs no control transfer. */
+struct usb_string_cache {
+	int lang_valid; /* boolean */
+	uint16_t lang;
+	wchar_t *strings[256];
+};
+
+/* Slot in the ring of input reports received from the device. The
+   data buffers are allocated once in hid_open_path() and reused. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
-	struct input_report *next;
 };
 
 
@@ -154,40 +108,112 @@ struct hid_device_ {
 	/* The interface number of the HID */
 	int interface;
 
+	/* Whether the kernel driver was detached from the interface */
+	int is_driver_detached; /* boolean */
+
 	/* Indexes of Strings */
 	int manufacturer_index;
 	int product_index;
 	int serial_index;
 
+	/* Strings already read from the device */
+	struct usb_string_cache string_cache;
+
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
-	pthread_t thread;
+	/* Whether reads are synchronous transfers (HID_OPEN_NO_READ_THREAD) */
+	int synchronous; /* boolean */
+
+	/* Whether hid_close() keeps the interface claimed (HID_OPEN_KEEP_CLAIMED) */
+	int keep_claimed; /* boolean */
+
+	/* The path the device was opened with */
+	char *path;
+
+	/* Next handle kept claimed after hid_close() */
+	hid_device *next_claimed;
+
+	/* Read objects. Transfers are serviced by the shared event thread. */
 	pthread_mutex_t mutex; /* Protects input_reports */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
-	int shutdown_thread;
+	int shutdown_reading;
 	int cancelled;
-	struct libusb_transfer *transfer;
-
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	struct libusb_transfer *transfers[HID_MAX_READ_TRANSFERS];
+	unsigned char *transfer_buffer;
+	int num_transfers;
+	int transfers_in_flight;
+
+	/* Writes from hid_write_async() which haven't completed yet, and
+	   whether a synchronous device holds the event thread for them. */
+	int writes_in_flight;
+	int write_event_thread; /* boolean */
+
+	/* eventfd which is readable while reports are queued or reading
+	   has stopped, for callers running their own event loop. */
+	int event_fd;
+
+	/* Ring of received input reports. */
+	struct input_report input_reports[INPUT_REPORT_QUEUE_SIZE];
+	uint8_t *input_report_buffer;
+	int input_report_head;
+	int input_report_count;
+	uint8_t *lent_report; /* Buffer of the report lent by hid_read_borrow() */
+	uint8_t *spare_report; /* Buffer swapped into the ring for it */
+	int queue_policy;
+
+	/* Queue statistics */
+	int queue_high_water_mark;
+	unsigned long queue_overflows;
+
+	/* Errors, protected by mutex. last_error_str is returned by
+	   hid_error() and is empty until the first error. */
+	struct hid_error_stats errors;
+	wchar_t last_error_str[64];
 };
 
 static libusb_context *usb_context = NULL;
 
+/* A single thread handles the libusb events of every open device. It
+   is started by the first hid_open_path() and stopped by the last
+   hid_close(). */
+static pthread_mutex_t event_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t event_thread;
+static int event_thread_refs = 0;
+static int event_thread_shutdown = 0;
+
+/* Number of interrupt IN transfers kept in flight per device */
+static int read_transfer_count = 1;
+
+/* How hid_enumerate() names devices (enum hid_path_scheme) */
+static int path_scheme = HID_PATH_BY_ADDRESS;
+
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static int alloc_input_reports(hid_device *dev);
+static void reset_input_reports(hid_device *dev);
+static void stop_reading(hid_device *dev);
+static void set_event_fd(hid_device *dev, int readable);
+static void free_string_cache(struct usb_string_cache *cache);
+static int acquire_event_thread(void);
+static void release_event_thread(void);
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
+	pthread_condattr_t attr;
 	dev->blocking = 1;
+	dev->event_fd = -1;
+
+	/* Timed waits are measured against the monotonic clock, so that
+	   they aren't cut short or stretched when the wall clock is set. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
 
 	pthread_mutex_init(&dev->mutex, NULL);
-	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	pthread_cond_init(&dev->condition, &attr);
+
+	pthread_condattr_destroy(&attr);
 
 	return dev;
 }
@@ -195,21 +221,60 @@ static hid_device *new_hid_device(void)
 static void free_hid_device(hid_device *dev)
 {
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	/* Free the input report slots */
+	free(dev->input_report_buffer);
+
+	/* Close the eventfd */
+	if (dev->event_fd >= 0)
+		close(dev->event_fd);
+
+	/* Free the cached strings */
+	free_string_cache(&dev->string_cache);
+
+	free(dev->path);
+
 	/* Free the device itself */
 	free(dev);
 }
 
-#if 0
-/*TODO: Implement this funciton on hidapi/libusb.. */
-static void register_error(hid_device *device, const char *op)
+/* Record a libusb error for hid_error() and hid_get_error_stats().
+   op names the function which failed. Don't call with dev->mutex held. */
+static void register_error(hid_device *dev, const char *op, int error)
 {
+	pthread_mutex_lock(&dev->mutex);
+	dev->errors.last_error = error;
+	if (error == LIBUSB_ERROR_TIMEOUT)
+		dev->errors.timeouts++;
+	else if (error == LIBUSB_ERROR_PIPE)
+		dev->errors.stalls++;
+	else if (error == LIBUSB_ERROR_NO_DEVICE)
+		dev->errors.no_device++;
+	swprintf(dev->last_error_str, sizeof(dev->last_error_str) / sizeof(wchar_t),
+		L"%s: %s", op, libusb_error_name(error));
+	pthread_mutex_unlock(&dev->mutex);
+}
 
+/* The libusb error code matching the status of a failed transfer. */
+static int transfer_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
 }
-#endif
 
 #ifdef INVASIVE_GET_USAGE
 /* Get bytes from a HID Report Descriptor.
@@ -335,12 +400,19 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 #endif
 
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
+/* Choose the language to read strings in: the one for the current
+   locale if the device supports it, otherwise the first one it lists
+   in USB string #0. The choice is remembered in the cache, so string
+   #0 is only read once. */
+static uint16_t get_usb_language(libusb_device_handle *dev, struct usb_string_cache *cache)
 {
 	uint16_t buf[32];
+	uint16_t lang;
 	int len;
+	int i;
+
+	if (cache->lang_valid)
+		return cache->lang;
 
 	/* Get the string from libusb. */
 	len = libusb_get_string_descriptor(dev,
@@ -349,362 +421,1200 @@ static uint16_t get_first_language(libusb_device_handle *dev)
 			(unsigned char*)buf,
 			sizeof(buf));
 	if (len < 4)
-		return 0x0;
+		return 0x0; /* Try again next time */
+
+	lang = get_usb_code_for_current_locale();
+	len /= 2; /* language IDs are two-bytes each. */
+	/* Start at index 1 because there are two bytes of protocol data. */
+	for (i = 1; i < len; i++) {
+		if (buf[i] == lang)
+			break;
+	}
+	if (i == len)
+		lang = buf[1]; /* Not supported, use the first language. */
 
-	return buf[1]; /* First two bytes are len and descriptor type. */
+	cache->lang = lang;
+	cache->lang_valid = 1;
+
+	return lang;
 }
 
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+static void free_string_cache(struct usb_string_cache *cache)
 {
-	uint16_t buf[32];
-	int len;
 	int i;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
+	for (i = 0; i < 256; i++) {
+		free(cache->strings[i]);
+		cache->strings[i] = NULL;
+	}
+	cache->lang_valid = 0;
+}
 
+/* Decode len bytes of UTF-16LE text, as found in USB string descriptors,
+   into a newly allocated wide string. wchar_t holds UTF-32 on the
+   platforms this file builds for, so surrogate pairs are combined into
+   one character. Unpaired surrogates become U+FFFD. */
+static wchar_t *utf16le_to_wchar(const unsigned char *data, size_t len)
+{
+	size_t count = len / 2;
+	size_t i, j = 0;
+	wchar_t *str = malloc((count + 1) * sizeof(wchar_t));
+	if (!str)
+		return NULL;
 
-	len /= 2; /* language IDs are two-bytes each. */
-	/* Start at index 1 because there are two bytes of protocol data. */
-	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
+	for (i = 0; i < count; i++) {
+		uint32_t code = data[2*i] | (data[2*i+1] << 8);
+
+		if (code >= 0xD800 && code <= 0xDBFF && i + 1 < count) {
+			uint32_t low = data[2*i+2] | (data[2*i+3] << 8);
+			if (low >= 0xDC00 && low <= 0xDFFF) {
+				code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+				i++;
+			}
+			else
+				code = 0xFFFD;
+		}
+		else if (code >= 0xD800 && code <= 0xDFFF)
+			code = 0xFFFD;
+
+		str[j++] = code;
 	}
+	str[j] = 0x00000000;
 
-	return 0;
+	return str;
 }
 
-
 /* This function returns a newly allocated wide string containing the USB
    device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+   by using free(). Strings are looked up in and added to cache. */
+static wchar_t *get_usb_string(libusb_device_handle *dev, struct usb_string_cache *cache, uint8_t idx)
 {
-	char buf[512];
+	unsigned char buf[512];
 	int len;
-	wchar_t *str = NULL;
-
-#ifndef __ANDROID__ /* we don't use iconv on Android */
-	wchar_t wbuf[256];
-	/* iconv variables */
-	iconv_t ic;
-	size_t inbytes;
-	size_t outbytes;
-	size_t res;
-#ifdef __FreeBSD__
-	const char *inptr;
-#else
-	char *inptr;
-#endif
-	char *outptr;
-#endif
+	wchar_t *str;
 
 	/* Determine which language to use. */
 	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
+
+	if (cache->strings[idx])
+		return wcsdup(cache->strings[idx]);
+
+	lang = get_usb_language(dev, cache);
 
 	/* Get the string from libusb. */
 	len = libusb_get_string_descriptor(dev,
 			idx,
 			lang,
-			(unsigned char*)buf,
+			buf,
 			sizeof(buf));
-	if (len < 0)
+	if (len < 2)
 		return NULL;
 
-#ifdef __ANDROID__
+	/* Skip the first character (2-bytes), which holds the length
+	   and descriptor type. */
+	str = utf16le_to_wchar(buf + 2, len - 2);
 
-	/* Bionic does not have iconv support nor wcsdup() function, so it
-	   has to be done manually.  The following code will only work for
-	   code points that can be represented as a single UTF-16 character,
-	   and will incorrectly convert any code points which require more
-	   than one UTF-16 character.
+	if (str)
+		cache->strings[idx] = wcsdup(str);
 
-	   Skip over the first character (2-bytes).  */
-	len -= 2;
-	str = malloc((len / 2 + 1) * sizeof(wchar_t));
-	int i;
-	for (i = 0; i < len / 2; i++) {
-		str[i] = buf[i * 2 + 2] | (buf[i * 2 + 3] << 8);
-	}
-	str[len / 2] = 0x00000000;
+	return str;
+}
 
-#else
+/* Write the bus number and port chain of dev, as in 1-4.2, into buf.
+   This is also the name of the device's directory in sysfs. Returns
+   the length, or -1 for a root hub or if the ports are unknown. */
+static int get_port_path(libusb_device *dev, char *buf, size_t size)
+{
+	uint8_t ports[8];
+	int num_ports;
+	int i, pos;
 
-	/* buf does not need to be explicitly NULL-terminated because
-	   it is only passed into iconv() which does not need it. */
+	num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	if (num_ports <= 0)
+		return -1;
+	pos = snprintf(buf, size, "%d-%d", libusb_get_bus_number(dev), ports[0]);
+	for (i = 1; i < num_ports && (size_t)pos < size; i++)
+		pos += snprintf(buf + pos, size - pos, ".%d", ports[i]);
 
-	/* Initialize iconv. */
-	ic = iconv_open("WCHAR_T", "UTF-16LE");
-	if (ic == (iconv_t)-1) {
-		LOG("iconv_open() failed\n");
-		return NULL;
-	}
+	return ((size_t)pos < size)? pos: -1;
+}
 
-	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
-	   Skip the first character (2-bytes). */
-	inptr = buf+2;
-	inbytes = len-2;
-	outptr = (char*) wbuf;
-	outbytes = sizeof(wbuf);
-	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
-	if (res == (size_t)-1) {
-		LOG("iconv() failed\n");
-		goto err;
+/* Paths by address look like 0001:0005:00 (bus, address, interface),
+   which changes whenever the device is plugged in again. Paths by port
+   look like 1-4.2:00 (bus and port chain, interface), which stays the
+   same for as long as the device is in the same port. */
+static char *make_path_scheme(libusb_device *dev, int interface_number, int scheme)
+{
+	char str[64];
+	int len;
+
+	if (scheme == HID_PATH_BY_PORT &&
+	    (len = get_port_path(dev, str, sizeof(str))) >= 0) {
+		snprintf(str + len, sizeof(str) - len, ":%02x", interface_number);
+	}
+	else {
+		snprintf(str, sizeof(str), "%04x:%04x:%02x",
+			libusb_get_bus_number(dev),
+			libusb_get_device_address(dev),
+			interface_number);
 	}
+	str[sizeof(str)-1] = '\0';
 
-	/* Write the terminating NULL. */
-	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
-	if (outbytes >= sizeof(wbuf[0]))
-		*((wchar_t*)outptr) = 0x00000000;
+	return strdup(str);
+}
 
-	/* Allocate and copy the string. */
-	str = wcsdup(wbuf);
+static char *make_path(libusb_device *dev, int interface_number)
+{
+	return make_path_scheme(dev, interface_number, path_scheme);
+}
 
-err:
-	iconv_close(ic);
+/* Returns 1 if path names the interface of dev, in either scheme. */
+static int path_matches(libusb_device *dev, int interface_number, const char *path)
+{
+	int scheme = strchr(path, '-')? HID_PATH_BY_PORT: HID_PATH_BY_ADDRESS;
+	char *dev_path = make_path_scheme(dev, interface_number, scheme);
+	int match = dev_path && !strcmp(dev_path, path);
 
-#endif
+	free(dev_path);
 
-	return str;
+	return match;
 }
 
-static char *make_path(libusb_device *dev, int interface_number)
+/* Returns 1 if path could name an interface of dev. Only the bus and
+   address or port chain are compared, which needs no descriptors. */
+static int path_names_device(libusb_device *dev, const char *path)
 {
+	const char *colon = strrchr(path, ':');
 	char str[64];
-	snprintf(str, sizeof(str), "%04x:%04x:%02x",
-		libusb_get_bus_number(dev),
-		libusb_get_device_address(dev),
-		interface_number);
-	str[sizeof(str)-1] = '\0';
 
-	return strdup(str);
+	if (!colon)
+		return 0;
+
+	if (strchr(path, '-')) {
+		if (get_port_path(dev, str, sizeof(str)) < 0)
+			return 0;
+	}
+	else {
+		snprintf(str, sizeof(str), "%04x:%04x",
+			libusb_get_bus_number(dev),
+			libusb_get_device_address(dev));
+	}
+
+	return strlen(str) == (size_t)(colon - path) && !strncmp(str, path, colon - path);
 }
 
+#ifdef __linux__
+/* Directory in which the kernel lists USB devices, named after their
+   bus and port chain (for example 1-4.2). */
+#define SYSFS_USB_DEVICES "/sys/bus/usb/devices"
 
-int HID_API_EXPORT hid_init(void)
+/* Decode UTF-8 text of length len into a newly allocated wide string.
+   Invalid bytes are replaced with U+FFFD. */
+static wchar_t *utf8_to_wchar(const char *text, size_t len)
 {
-	if (!usb_context) {
-		const char *locale;
+	size_t i = 0, j = 0;
+	wchar_t *str = malloc((len + 1) * sizeof(wchar_t));
+	if (!str)
+		return NULL;
 
-		/* Init Libusb */
-		if (libusb_init(&usb_context))
-			return -1;
+	while (i < len) {
+		unsigned char c = text[i++];
+		uint32_t code;
+		int extra;
 
-		/* Set the locale if it's not set. */
-		locale = setlocale(LC_CTYPE, NULL);
-		if (!locale)
-			setlocale(LC_CTYPE, "");
-	}
+		if (c < 0x80) {
+			code = c;
+			extra = 0;
+		}
+		else if ((c & 0xE0) == 0xC0) {
+			code = c & 0x1F;
+			extra = 1;
+		}
+		else if ((c & 0xF0) == 0xE0) {
+			code = c & 0x0F;
+			extra = 2;
+		}
+		else if ((c & 0xF8) == 0xF0) {
+			code = c & 0x07;
+			extra = 3;
+		}
+		else {
+			code = 0xFFFD;
+			extra = 0;
+		}
 
-	return 0;
-}
+		while (extra > 0 && i < len && (text[i] & 0xC0) == 0x80) {
+			code = (code << 6) | (text[i++] & 0x3F);
+			extra--;
+		}
+		if (extra > 0)
+			code = 0xFFFD;
 
-int HID_API_EXPORT hid_exit(void)
-{
-	if (usb_context) {
-		libusb_exit(usb_context);
-		usb_context = NULL;
+		str[j++] = code;
 	}
+	str[j] = 0x00000000;
 
-	return 0;
+	return str;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Read the attribute file attr of the sysfs USB device directory name
+   into buf, without the trailing newline. Returns the length read, or
+   -1 if there is no such file. */
+static int read_sysfs_attr(const char *name, const char *attr, char *buf, size_t size)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
+	char path[256];
+	int fd;
+	ssize_t len;
 
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
+	snprintf(path, sizeof(path), SYSFS_USB_DEVICES "/%s/%s", name, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
 
-	if(hid_init() < 0)
-		return NULL;
+	while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\0'))
+		len--;
+	buf[len] = '\0';
 
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
+	return len;
+}
+
+static wchar_t *get_sysfs_string(const char *name, const char *attr)
+{
+	char buf[512];
+	int len = read_sysfs_attr(name, attr, buf, sizeof(buf));
+	if (len < 0)
 		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
+	return utf8_to_wchar(buf, len);
+}
 
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
+/* Fill in the strings of info selected by fields from sysfs. Returns 0
+   if every one of them was found, and -1 otherwise, in which case info
+   is left unchanged. */
+static int get_sysfs_strings(libusb_device *dev, struct hid_device_info *info, int fields)
+{
+	char name[64];
+	char buf[16];
+	wchar_t *serial_number = NULL;
+	wchar_t *manufacturer_string = NULL;
+	wchar_t *product_string = NULL;
+
+	/* Name the directory from the bus number and port chain. */
+	if (get_port_path(dev, name, sizeof(name)) < 0)
+		return -1;
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
+	/* Make sure the directory is for this device. */
+	if (read_sysfs_attr(name, "devnum", buf, sizeof(buf)) < 0 ||
+	    atoi(buf) != libusb_get_device_address(dev))
+		return -1;
 
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
+	if ((fields & HID_INFO_SERIAL_NUMBER) && !(serial_number = get_sysfs_string(name, "serial")))
+		goto err;
+	if ((fields & HID_INFO_MANUFACTURER_STRING) && !(manufacturer_string = get_sysfs_string(name, "manufacturer")))
+		goto err;
+	if ((fields & HID_INFO_PRODUCT_STRING) && !(product_string = get_sysfs_string(name, "product")))
+		goto err;
 
-							res = libusb_open(dev, &handle);
+	info->serial_number = serial_number;
+	info->manufacturer_string = manufacturer_string;
+	info->product_string = product_string;
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+	return 0;
 
-#ifdef INVASIVE_GET_USAGE
+err:
+	free(serial_number);
+	free(manufacturer_string);
+	free(product_string);
+	return -1;
+}
+#else
+static int get_sysfs_strings(libusb_device *dev, struct hid_device_info *info, int fields)
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
-#ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
-#endif
-								res = libusb_claim_interface(handle, interface_num);
-								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
-								}
-								else
-									LOG("Can't claim interface %d\n", res);
-#ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
-#endif
+	return -1;
 }
-#endif /* INVASIVE_GET_USAGE */
+#endif
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+/* Index of the paths found by the last hid_enumerate(), so that
+   hid_open_path() can go straight to the device rather than walking
+   the whole bus. Each entry holds a reference on its libusb device.
+   An entry is stale if the device has since gone away, which
+   hid_open_path() finds out when it tries to open it. */
+#define PATH_INDEX_SIZE 64
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+struct path_index_entry {
+	char *path;
+	libusb_device *usb_dev;
+	struct path_index_entry *next;
+};
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
-					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
+static struct path_index_entry *path_index[PATH_INDEX_SIZE];
+static pthread_mutex_t path_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_path(const char *path)
+{
+	unsigned int hash = 5381;
+	while (*path)
+		hash = hash * 33 + (unsigned char)*path++;
+	return hash % PATH_INDEX_SIZE;
+}
+
+/* This should be called with path_index_mutex locked. */
+static void path_index_clear(void)
+{
+	int i;
+	for (i = 0; i < PATH_INDEX_SIZE; i++) {
+		struct path_index_entry *entry = path_index[i];
+		while (entry) {
+			struct path_index_entry *next = entry->next;
+			libusb_unref_device(entry->usb_dev);
+			free(entry->path);
+			free(entry);
+			entry = next;
 		}
+		path_index[i] = NULL;
 	}
+}
 
-	libusb_free_device_list(devs, 1);
-
-	return root;
+static void path_index_reset(void)
+{
+	pthread_mutex_lock(&path_index_mutex);
+	path_index_clear();
+	pthread_mutex_unlock(&path_index_mutex);
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+static void path_index_add(const char *path, libusb_device *usb_dev)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
+	unsigned int hash = hash_path(path);
+	struct path_index_entry *entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return;
+	entry->path = strdup(path);
+	if (!entry->path) {
+		free(entry);
+		return;
 	}
+	entry->usb_dev = libusb_ref_device(usb_dev);
+
+	pthread_mutex_lock(&path_index_mutex);
+	entry->next = path_index[hash];
+	path_index[hash] = entry;
+	pthread_mutex_unlock(&path_index_mutex);
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+/* Returns a new reference on the device at path, or NULL. */
+static libusb_device *path_index_find(const char *path)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	struct path_index_entry *entry;
+	libusb_device *usb_dev = NULL;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
+	pthread_mutex_lock(&path_index_mutex);
+	for (entry = path_index[hash_path(path)]; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path)) {
+			usb_dev = libusb_ref_device(entry->usb_dev);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&path_index_mutex);
+
+	return usb_dev;
+}
+
+static void path_index_remove(const char *path)
+{
+	struct path_index_entry **link;
+
+	pthread_mutex_lock(&path_index_mutex);
+	for (link = &path_index[hash_path(path)]; *link; link = &(*link)->next) {
+		struct path_index_entry *entry = *link;
+		if (!strcmp(entry->path, path)) {
+			*link = entry->next;
+			libusb_unref_device(entry->usb_dev);
+			free(entry->path);
+			free(entry);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&path_index_mutex);
+}
+
+/* Strings read from the device in each port, kept across enumerations
+   so that the device doesn't have to be opened again to read them. An
+   entry belongs to one attachment of a device. Addresses are reused,
+   so the entry also records the IDs from the device descriptor, and it
+   is dropped when the device is detached or doesn't match. */
+struct port_cache_entry {
+	char *port;
+	uint8_t address;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t release_number;
+	struct usb_string_cache strings;
+	struct port_cache_entry *next;
+};
+
+static struct port_cache_entry *port_cache[PATH_INDEX_SIZE];
+static pthread_mutex_t port_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_port_cache_entry(struct port_cache_entry *entry)
+{
+	free_string_cache(&entry->strings);
+	free(entry->port);
+	free(entry);
+}
+
+static void port_cache_reset(void)
+{
+	int i;
+
+	pthread_mutex_lock(&port_cache_mutex);
+	for (i = 0; i < PATH_INDEX_SIZE; i++) {
+		struct port_cache_entry *entry = port_cache[i];
+		while (entry) {
+			struct port_cache_entry *next = entry->next;
+			free_port_cache_entry(entry);
+			entry = next;
+		}
+		port_cache[i] = NULL;
+	}
+	pthread_mutex_unlock(&port_cache_mutex);
+}
+
+/* This should be called with port_cache_mutex locked. */
+static struct port_cache_entry *port_cache_find(const char *port)
+{
+	struct port_cache_entry *entry;
+
+	for (entry = port_cache[hash_path(port)]; entry; entry = entry->next) {
+		if (!strcmp(entry->port, port))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Drop the entry for port. This should be called with
+   port_cache_mutex locked. */
+static void port_cache_drop(const char *port)
+{
+	struct port_cache_entry **link;
+
+	for (link = &port_cache[hash_path(port)]; *link; link = &(*link)->next) {
+		struct port_cache_entry *entry = *link;
+		if (!strcmp(entry->port, port)) {
+			*link = entry->next;
+			free_port_cache_entry(entry);
+			return;
+		}
+	}
+}
+
+/* Returns 1 if entry was made for the device now attached as dev. */
+static int port_cache_matches(const struct port_cache_entry *entry, libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return 0;
+
+	return entry->address == libusb_get_device_address(dev) &&
+		entry->vendor_id == desc.idVendor &&
+		entry->product_id == desc.idProduct &&
+		entry->release_number == desc.bcdDevice;
+}
+
+/* Forget the strings cached for the port of dev, when it is detached. */
+static void port_cache_remove(libusb_device *dev)
+{
+	char port[64];
+
+	if (get_port_path(dev, port, sizeof(port)) < 0)
+		return;
+
+	pthread_mutex_lock(&port_cache_mutex);
+	port_cache_drop(port);
+	pthread_mutex_unlock(&port_cache_mutex);
+}
+
+/* Copy the strings cached for dev into cache. */
+static void port_cache_load(libusb_device *dev, struct usb_string_cache *cache)
+{
+	struct port_cache_entry *entry;
+	char port[64];
+	int i;
+
+	if (get_port_path(dev, port, sizeof(port)) < 0)
+		return;
+
+	pthread_mutex_lock(&port_cache_mutex);
+	entry = port_cache_find(port);
+	if (entry && !port_cache_matches(entry, dev)) {
+		/* A different device is in the port now. */
+		port_cache_drop(port);
+		entry = NULL;
+	}
+	if (entry) {
+		cache->lang = entry->strings.lang;
+		cache->lang_valid = entry->strings.lang_valid;
+		for (i = 0; i < 256; i++) {
+			if (entry->strings.strings[i] && !cache->strings[i])
+				cache->strings[i] = wcsdup(entry->strings.strings[i]);
+		}
+	}
+	pthread_mutex_unlock(&port_cache_mutex);
+}
+
+/* Add the strings in cache to those cached for dev. */
+static void port_cache_store(libusb_device *dev, const struct usb_string_cache *cache)
+{
+	struct port_cache_entry *entry;
+	struct libusb_device_descriptor desc;
+	char port[64];
+	int i;
+
+	if (get_port_path(dev, port, sizeof(port)) < 0)
+		return;
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return;
+
+	pthread_mutex_lock(&port_cache_mutex);
+	entry = port_cache_find(port);
+	if (entry && !port_cache_matches(entry, dev)) {
+		/* A different device is in the port now. */
+		port_cache_drop(port);
+		entry = NULL;
+	}
+	if (!entry) {
+		unsigned int hash = hash_path(port);
+		entry = calloc(1, sizeof(*entry));
+		if (!entry || !(entry->port = strdup(port))) {
+			free(entry);
+			goto out;
+		}
+		entry->address = libusb_get_device_address(dev);
+		entry->vendor_id = desc.idVendor;
+		entry->product_id = desc.idProduct;
+		entry->release_number = desc.bcdDevice;
+		entry->next = port_cache[hash];
+		port_cache[hash] = entry;
+	}
+
+	if (cache->lang_valid) {
+		entry->strings.lang = cache->lang;
+		entry->strings.lang_valid = 1;
+	}
+	for (i = 0; i < 256; i++) {
+		if (cache->strings[i] && !entry->strings.strings[i])
+			entry->strings.strings[i] = wcsdup(cache->strings[i]);
+	}
+
+out:
+	pthread_mutex_unlock(&port_cache_mutex);
+}
+
+/* Returns 1 if every string selected by fields is in cache. */
+static int usb_strings_cached(const struct usb_string_cache *cache, const struct libusb_device_descriptor *desc, int fields)
+{
+	if ((fields & HID_INFO_SERIAL_NUMBER) && !cache->strings[desc->iSerialNumber])
+		return 0;
+	if ((fields & HID_INFO_MANUFACTURER_STRING) && !cache->strings[desc->iManufacturer])
+		return 0;
+	if ((fields & HID_INFO_PRODUCT_STRING) && !cache->strings[desc->iProduct])
+		return 0;
+	return 1;
+}
+
+/* Fill in the strings of info selected by fields. handle is only used
+   for strings which aren't in cache. */
+static void get_usb_strings(libusb_device_handle *handle, struct usb_string_cache *cache, const struct libusb_device_descriptor *desc, struct hid_device_info *info, int fields)
+{
+	/* Serial Number */
+	if (fields & HID_INFO_SERIAL_NUMBER)
+		info->serial_number = get_usb_string(handle, cache, desc->iSerialNumber);
+
+	/* Manufacturer and Product strings */
+	if (fields & HID_INFO_MANUFACTURER_STRING)
+		info->manufacturer_string = get_usb_string(handle, cache, desc->iManufacturer);
+	if (fields & HID_INFO_PRODUCT_STRING)
+		info->product_string = get_usb_string(handle, cache, desc->iProduct);
+}
+
+
+int HID_API_EXPORT hid_init(void)
+{
+	if (!usb_context) {
+		const char *locale;
+
+		/* Init Libusb */
+		if (libusb_init(&usb_context))
+			return -1;
+
+		/* Set the locale if it's not set. */
+		locale = setlocale(LC_CTYPE, NULL);
+		if (!locale)
+			setlocale(LC_CTYPE, "");
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	if (usb_context) {
+		hid_registry_stop();
+		hid_release_claimed(NULL);
+		path_index_reset();
+		port_cache_reset();
+
+		libusb_exit(usb_context);
+		usb_context = NULL;
+	}
+
+	return 0;
+}
+
+/* Create the records for the HID interfaces of one USB device which
+   match vendor_id and product_id, and add their paths to the index. */
+static struct hid_device_info *enumerate_device(libusb_device *dev, unsigned short vendor_id, unsigned short product_id, int fields)
+{
+	libusb_device_handle *handle;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int j, k;
+	int interface_num = 0;
+	int wanted_strings;
+	int need_strings;
+	struct usb_string_cache strings;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	int res = libusb_get_device_descriptor(dev, &desc);
+	unsigned short dev_vid = desc.idVendor;
+	unsigned short dev_pid = desc.idProduct;
+
+	/* Check the VID/PID against the arguments before reading the
+	   configuration descriptor. */
+	if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+	    (product_id != 0x0 && product_id != dev_pid))
+		return NULL;
+
+	/* Only read the strings which were asked for and exist. */
+	wanted_strings = 0;
+	if (desc.iSerialNumber > 0)
+		wanted_strings |= fields & HID_INFO_SERIAL_NUMBER;
+	if (desc.iManufacturer > 0)
+		wanted_strings |= fields & HID_INFO_MANUFACTURER_STRING;
+	if (desc.iProduct > 0)
+		wanted_strings |= fields & HID_INFO_PRODUCT_STRING;
+
+	/* Every HID interface of the device shares the same strings,
+	   starting with those read during earlier enumerations. */
+	memset(&strings, 0, sizeof(strings));
+	port_cache_load(dev, &strings);
+
+	res = libusb_get_active_config_descriptor(dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (conf_desc) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					struct hid_device_info *tmp;
+					interface_num = intf_desc->bInterfaceNumber;
+
+					/* Create the record. */
+					tmp = calloc(1, sizeof(struct hid_device_info));
+					if (cur_dev) {
+						cur_dev->next = tmp;
+					}
+					else {
+						root = tmp;
+					}
+					cur_dev = tmp;
+
+					/* Fill out the record */
+					cur_dev->next = NULL;
+					cur_dev->path = make_path(dev, interface_num);
+					if (cur_dev->path)
+						path_index_add(cur_dev->path, dev);
+
+					/* Take the strings from the cache, or from sysfs
+					   if it has them, neither of which needs the
+					   device to be opened. */
+					need_strings = 0;
+					if (usb_strings_cached(&strings, &desc, wanted_strings))
+						get_usb_strings(NULL, &strings, &desc, cur_dev, wanted_strings);
+					else if (get_sysfs_strings(dev, cur_dev, wanted_strings) < 0)
+						need_strings = 1;
+
+#ifdef INVASIVE_GET_USAGE
+					res = libusb_open(dev, &handle);
+#else
+					res = need_strings? libusb_open(dev, &handle): LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+
+					if (res >= 0) {
+						if (need_strings)
+							get_usb_strings(handle, &strings, &desc, cur_dev, wanted_strings);
+
+#ifdef INVASIVE_GET_USAGE
+{
+					/*
+					This section is removed because it is too
+					invasive on the system. Getting a Usage Page
+					and Usage requires parsing the HID Report
+					descriptor. Getting a HID Report descriptor
+					involves claiming the interface. Claiming the
+					interface involves detaching the kernel driver.
+					Detaching the kernel driver is hard on the system
+					because it will unclaim interfaces (if another
+					app has them claimed) and the re-attachment of
+					the driver will sometimes change /dev entry names.
+					It is for these reasons that this section is
+					#if 0. For composite devices, use the interface
+					field in the hid_device_info struct to distinguish
+					between interfaces. */
+						unsigned char data[256];
+#ifdef DETACH_KERNEL_DRIVER
+						int detached = 0;
+						/* Usage Page and Usage */
+						res = libusb_kernel_driver_active(handle, interface_num);
+						if (res == 1) {
+							res = libusb_detach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+							else
+								detached = 1;
+						}
+#endif
+						res = libusb_claim_interface(handle, interface_num);
+						if (res >= 0) {
+							/* Get the HID Report Descriptor. */
+							res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
+							if (res >= 0) {
+								unsigned short page=0, usage=0;
+								/* Parse the usage and usage page
+								   out of the report descriptor. */
+								get_usage(data, res,  &page, &usage);
+								cur_dev->usage_page = page;
+								cur_dev->usage = usage;
+							}
+							else
+								LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+							/* Release the interface */
+							res = libusb_release_interface(handle, interface_num);
+							if (res < 0)
+								LOG("Can't release the interface.\n");
+						}
+						else
+							LOG("Can't claim interface %d\n", res);
+#ifdef DETACH_KERNEL_DRIVER
+						/* Re-attach kernel driver if necessary. */
+						if (detached) {
+							res = libusb_attach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't re-attach kernel driver.\n");
+						}
+#endif
+}
+#endif /* INVASIVE_GET_USAGE */
+
+						libusb_close(handle);
+					}
+					/* VID/PID */
+					cur_dev->vendor_id = dev_vid;
+					cur_dev->product_id = dev_pid;
+
+					/* Release Number */
+					cur_dev->release_number = desc.bcdDevice;
+
+					/* Interface Number */
+					cur_dev->interface_number = interface_num;
+				}
+			} /* altsettings */
+		} /* interfaces */
+		libusb_free_config_descriptor(conf_desc);
+	}
+
+	port_cache_store(dev, &strings);
+	free_string_cache(&strings);
+
+	return root;
+}
+
+/* Optional registry of attached devices, kept up to date by libusb
+   hotplug events. While it is running, hid_enumerate() returns a copy
+   of it instead of scanning the bus. Hotplug callbacks run on the
+   event thread, where blocking transfers are not allowed, so they only
+   queue the event. The registry thread then reads the device strings,
+   updates the table and notifies the caller. */
+struct registry_event {
+	libusb_device *usb_dev;
+	int arrived;
+	struct registry_event *next;
+};
+
+struct registry_entry {
+	libusb_device *usb_dev;
+	struct hid_device_info *info;
+	struct registry_entry *next;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_condition = PTHREAD_COND_INITIALIZER;
+static pthread_t registry_thread;
+static int registry_running = 0;
+static int registry_shutdown = 0;
+static int registry_busy = 0;
+static unsigned short registry_vendor_id;
+static unsigned short registry_product_id;
+static hid_registry_callback registry_callback;
+static void *registry_user_data;
+static libusb_hotplug_callback_handle registry_hotplug_handle;
+static struct registry_event *registry_events = NULL;
+static struct registry_event *registry_last_event = NULL;
+static struct registry_entry *registry_entries = NULL;
+
+static int LIBUSB_CALL registry_hotplug_callback(libusb_context *ctx, libusb_device *usb_dev,
+                                                 libusb_hotplug_event event, void *user_data)
+{
+	struct registry_event *evt = calloc(1, sizeof(*evt));
+	if (!evt)
+		return 0;
+	evt->usb_dev = libusb_ref_device(usb_dev);
+	evt->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+
+	/* Append to the queue and wake the registry thread. */
+	pthread_mutex_lock(&registry_mutex);
+	if (registry_last_event)
+		registry_last_event->next = evt;
+	else
+		registry_events = evt;
+	registry_last_event = evt;
+	pthread_cond_broadcast(&registry_condition);
+	pthread_mutex_unlock(&registry_mutex);
+
+	return 0; /* Stay registered */
+}
+
+static void registry_notify(struct hid_device_info *info, int attached)
+{
+	for (; info; info = info->next) {
+		if (!attached)
+			path_index_remove(info->path);
+		if (registry_callback)
+			registry_callback(info, attached, registry_user_data);
+	}
+}
+
+static void registry_handle_event(struct registry_event *evt)
+{
+	struct registry_entry *entry;
+	struct registry_entry **link;
+
+	if (evt->arrived) {
+		struct hid_device_info *info = enumerate_device(evt->usb_dev, registry_vendor_id, registry_product_id, HID_INFO_ALL_STRINGS);
+		if (!info)
+			return;
+		entry = calloc(1, sizeof(*entry));
+		if (!entry) {
+			hid_free_enumeration(info);
+			return;
+		}
+		entry->usb_dev = libusb_ref_device(evt->usb_dev);
+		entry->info = info;
+
+		pthread_mutex_lock(&registry_mutex);
+		entry->next = registry_entries;
+		registry_entries = entry;
+		pthread_mutex_unlock(&registry_mutex);
+
+		registry_notify(info, 1);
+	}
+	else {
+		/* Whatever is plugged into the port next is another device. */
+		port_cache_remove(evt->usb_dev);
+
+		/* Unlink the device's entry. */
+		pthread_mutex_lock(&registry_mutex);
+		for (link = &registry_entries; *link; link = &(*link)->next) {
+			if ((*link)->usb_dev == evt->usb_dev)
+				break;
+		}
+		entry = *link;
+		if (entry)
+			*link = entry->next;
+		pthread_mutex_unlock(&registry_mutex);
+
+		if (entry) {
+			registry_notify(entry->info, 0);
+			hid_free_enumeration(entry->info);
+			libusb_unref_device(entry->usb_dev);
+			free(entry);
+		}
+	}
+}
+
+static void *registry_thread_main(void *param)
+{
+	pthread_mutex_lock(&registry_mutex);
+	while (!registry_shutdown) {
+		struct registry_event *evt = registry_events;
+		if (!evt) {
+			pthread_cond_wait(&registry_condition, &registry_mutex);
+			continue;
+		}
+
+		/* Take the event off the queue and handle it unlocked. */
+		registry_events = evt->next;
+		if (!registry_events)
+			registry_last_event = NULL;
+		registry_busy = 1;
+		pthread_mutex_unlock(&registry_mutex);
+
+		registry_handle_event(evt);
+		libusb_unref_device(evt->usb_dev);
+		free(evt);
+
+		/* Let hid_registry_start() know when the queue has drained. */
+		pthread_mutex_lock(&registry_mutex);
+		registry_busy = 0;
+		pthread_cond_broadcast(&registry_condition);
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	return NULL;
+}
+
+/* Whether the registry tracks every device matching vendor_id and product_id. */
+static int registry_covers(unsigned short vendor_id, unsigned short product_id)
+{
+	return registry_running &&
+	       (registry_vendor_id == 0x0 || registry_vendor_id == vendor_id) &&
+	       (registry_product_id == 0x0 || registry_product_id == product_id);
+}
+
+static struct hid_device_info *copy_device_info(const struct hid_device_info *info)
+{
+	struct hid_device_info *copy = calloc(1, sizeof(*copy));
+	if (!copy)
+		return NULL;
+	*copy = *info;
+	copy->next = NULL;
+	copy->path = info->path? strdup(info->path): NULL;
+	copy->serial_number = info->serial_number? wcsdup(info->serial_number): NULL;
+	copy->manufacturer_string = info->manufacturer_string? wcsdup(info->manufacturer_string): NULL;
+	copy->product_string = info->product_string? wcsdup(info->product_string): NULL;
+	return copy;
+}
+
+/* Copy the registry records which match vendor_id and product_id. */
+static struct hid_device_info *registry_snapshot(unsigned short vendor_id, unsigned short product_id)
+{
+	struct registry_entry *entry;
+	struct hid_device_info *info;
+	struct hid_device_info *root = NULL;
+	struct hid_device_info *cur_dev = NULL;
+
+	pthread_mutex_lock(&registry_mutex);
+	for (entry = registry_entries; entry; entry = entry->next) {
+		for (info = entry->info; info; info = info->next) {
+			struct hid_device_info *tmp;
+			if ((vendor_id != 0x0 && vendor_id != info->vendor_id) ||
+			    (product_id != 0x0 && product_id != info->product_id))
+				continue;
+			tmp = copy_device_info(info);
+			if (!tmp)
+				continue;
+			if (cur_dev) {
+				cur_dev->next = tmp;
+			}
+			else {
+				root = tmp;
+			}
+			cur_dev = tmp;
+		}
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	return root;
+}
+
+int HID_API_EXPORT hid_registry_start(unsigned short vendor_id, unsigned short product_id, hid_registry_callback callback, void *user_data)
+{
+	int res;
+
+	if (hid_init() < 0)
+		return -1;
+
+	if (registry_running || !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -1;
+
+	registry_vendor_id = vendor_id;
+	registry_product_id = product_id;
+	registry_callback = callback;
+	registry_user_data = user_data;
+	registry_shutdown = 0;
+
+	if (pthread_create(&registry_thread, NULL, registry_thread_main, NULL) != 0)
+		return -1;
+
+	/* Hotplug events are delivered by the event thread. */
+	if (acquire_event_thread() < 0)
+		goto err;
+
+	/* LIBUSB_HOTPLUG_ENUMERATE queues the devices which are already
+	   attached before this call returns. */
+	res = libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		vendor_id? vendor_id: LIBUSB_HOTPLUG_MATCH_ANY,
+		product_id? product_id: LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY,
+		registry_hotplug_callback,
+		NULL,
+		&registry_hotplug_handle);
+	if (res != LIBUSB_SUCCESS) {
+		release_event_thread();
+		goto err;
+	}
+
+	/* Wait for the devices which are already attached to be read. */
+	pthread_mutex_lock(&registry_mutex);
+	while (registry_events || registry_busy)
+		pthread_cond_wait(&registry_condition, &registry_mutex);
+	registry_running = 1;
+	pthread_mutex_unlock(&registry_mutex);
+
+	return 0;
+
+err:
+	pthread_mutex_lock(&registry_mutex);
+	registry_shutdown = 1;
+	pthread_cond_broadcast(&registry_condition);
+	pthread_mutex_unlock(&registry_mutex);
+	pthread_join(registry_thread, NULL);
+	return -1;
+}
+
+void HID_API_EXPORT hid_registry_stop(void)
+{
+	if (!registry_running)
+		return;
+
+	libusb_hotplug_deregister_callback(usb_context, registry_hotplug_handle);
+	release_event_thread();
+
+	/* Stop the registry thread. */
+	pthread_mutex_lock(&registry_mutex);
+	registry_running = 0;
+	registry_shutdown = 1;
+	pthread_cond_broadcast(&registry_condition);
+	pthread_mutex_unlock(&registry_mutex);
+	pthread_join(registry_thread, NULL);
+
+	/* Free any unhandled events and the table. */
+	while (registry_events) {
+		struct registry_event *evt = registry_events;
+		registry_events = evt->next;
+		libusb_unref_device(evt->usb_dev);
+		free(evt);
+	}
+	registry_last_event = NULL;
+
+	while (registry_entries) {
+		struct registry_entry *entry = registry_entries;
+		registry_entries = entry->next;
+		hid_free_enumeration(entry->info);
+		libusb_unref_device(entry->usb_dev);
+		free(entry);
+	}
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	return hid_enumerate_fields(vendor_id, product_id, HID_INFO_ALL_STRINGS);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_fields(unsigned short vendor_id, unsigned short product_id, int fields)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t num_devs;
+	int i = 0;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	/* Answer from the registry if it tracks these devices. */
+	if (registry_covers(vendor_id, product_id))
+		return registry_snapshot(vendor_id, product_id);
+
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+
+	/* Rebuild the path index from this enumeration. */
+	path_index_reset();
+
+	while ((dev = devs[i++]) != NULL) {
+		struct hid_device_info *tmp = enumerate_device(dev, vendor_id, product_id, fields);
+
+		/* Attach the device's records to the end of the list. */
+		if (tmp) {
+			if (cur_dev) {
+				cur_dev->next = tmp;
+			}
+			else {
+				root = tmp;
+			}
+			cur_dev = tmp;
+			while (cur_dev->next)
+				cur_dev = cur_dev->next;
+		}
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	cur_dev = devs;
+	while (cur_dev) {
+		if (cur_dev->vendor_id == vendor_id &&
+		    cur_dev->product_id == product_id) {
+			if (serial_number) {
 				if (cur_dev->serial_number &&
 				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
 					path_to_open = cur_dev->path;
@@ -736,47 +1646,51 @@ static void read_callback(struct libusb_transfer *transfer)
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
 		pthread_mutex_lock(&dev->mutex);
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+		/* Apply the queue policy if the ring is full. This way
+		   we don't grow forever if the user never reads anything
+		   from the device. */
+		if (dev->input_report_count == INPUT_REPORT_QUEUE_SIZE) {
+			dev->queue_overflows++;
+			if (dev->queue_policy == HID_QUEUE_DROP_OLDEST)
+				return_data(dev, NULL, 0);
 		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
 
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
+		/* Put the new report in the slot after the last one. The
+		   slot takes the filled transfer buffer and the transfer
+		   receives into the slot's old buffer next time, so the
+		   report isn't copied. Both are the same size. */
+		if (dev->input_report_count < INPUT_REPORT_QUEUE_SIZE) {
+			int tail = (dev->input_report_head + dev->input_report_count) % INPUT_REPORT_QUEUE_SIZE;
+			struct input_report *rpt = &dev->input_reports[tail];
+			unsigned char *buf = rpt->data;
+			size_t len = transfer->actual_length;
+			if (len > (size_t)dev->input_ep_max_packet_size)
+				len = dev->input_ep_max_packet_size;
+			rpt->data = transfer->buffer;
+			rpt->len = len;
+			transfer->buffer = buf;
+
+			dev->input_report_count++;
+			if (dev->input_report_count > dev->queue_high_water_mark)
+				dev->queue_high_water_mark = dev->input_report_count;
+
+			/* Wake a reader if the queue was empty. */
+			if (dev->input_report_count == 1) {
+				pthread_cond_signal(&dev->condition);
+				set_event_fd(dev, 1);
 			}
 		}
 		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		stop_reading(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		register_error(dev, "hid_read", LIBUSB_ERROR_NO_DEVICE);
+		stop_reading(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
@@ -784,50 +1698,78 @@ static void read_callback(struct libusb_transfer *transfer)
 	}
 	else {
 		LOG("Unknown transfer code: %d\n", transfer->status);
+		register_error(dev, "hid_read", transfer_error(transfer->status));
 	}
 
-	/* Re-submit the transfer object. */
-	res = libusb_submit_transfer(transfer);
+	/* Re-submit the transfer object, unless hid_close() has been
+	   called. This is done under the mutex so that hid_close()
+	   either sees the transfer in flight and cancels it, or this
+	   function sees shutdown_reading and stops. */
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->shutdown_reading) {
+		res = LIBUSB_ERROR_INTERRUPTED;
+	}
+	else {
+		res = libusb_submit_transfer(transfer);
+		if (res != 0) {
+			LOG("Unable to submit URB. libusb error code: %d\n", res);
+			dev->errors.resubmit_failures++;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
 	if (res != 0) {
-		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		if (res != LIBUSB_ERROR_INTERRUPTED)
+			register_error(dev, "libusb_submit_transfer", res);
+		stop_reading(dev);
 	}
 }
 
-
-static void *read_thread(void *param)
+/* Make the device's eventfd readable or not. Called with dev->mutex
+   held, whenever the queue stops or starts being empty. */
+static void set_event_fd(hid_device *dev, int readable)
 {
-	hid_device *dev = param;
-	unsigned char *buf;
-	const size_t length = dev->input_ep_max_packet_size;
+#ifdef __linux__
+	eventfd_t value;
 
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
+	if (dev->event_fd < 0)
+		return;
+	if (readable)
+		eventfd_write(dev->event_fd, 1);
+	else
+		eventfd_read(dev->event_fd, &value);
+#endif
+}
 
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+/* Called when one of the device's transfers will not be re-submitted.
+   Mark the device as no longer reading, and once the last transfer
+   has finished mark it as cancelled. Wake any threads which are
+   waiting on data (in hid_read_timeout()) or on the final callback
+   (in hid_close()). Do this under a mutex to make sure that a thread
+   which is about to go to sleep waiting on the condition actually will
+   go to sleep before the condition is signaled. */
+static void stop_reading(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex);
+	if (!dev->shutdown_reading)
+		set_event_fd(dev, 1);
+	dev->shutdown_reading = 1;
+	if (--dev->transfers_in_flight == 0)
+		dev->cancelled = 1;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
 
-	/* Notify the main thread that the read thread is up and running. */
-	pthread_barrier_wait(&dev->barrier);
 
+static void *event_thread_main(void *param)
+{
 	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
+	while (!event_thread_shutdown) {
 		int res;
-		res = libusb_handle_events(usb_context);
+		res = libusb_handle_events_completed(usb_context, &event_thread_shutdown);
 		if (res < 0) {
 			/* There was an error. */
-			LOG("read_thread(): libusb reports error # %d\n", res);
+			LOG("event_thread_main(): libusb reports error # %d\n", res);
 
 			/* Break out of this loop only on fatal error.*/
 			if (res != LIBUSB_ERROR_BUSY &&
@@ -839,168 +1781,610 @@ static void *read_thread(void *param)
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+	return NULL;
+}
+
+/* Take a reference on the event thread, starting it if this is the
+   first open device. */
+static int acquire_event_thread(void)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_refs == 0) {
+		event_thread_shutdown = 0;
+		if (pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0)
+			res = -1;
+	}
+	if (res == 0)
+		event_thread_refs++;
+	pthread_mutex_unlock(&event_thread_mutex);
+
+	return res;
+}
+
+/* Stop the event thread. Must be called with event_thread_mutex
+   locked and event_thread_refs already dropped to zero. */
+static void stop_event_thread(void)
+{
+	event_thread_shutdown = 1;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(usb_context);
+#endif
+	pthread_join(event_thread, NULL);
+}
+
+/* Drop a reference on the event thread, stopping it if this was the
+   last open device. */
+static void release_event_thread(void)
+{
+	pthread_mutex_lock(&event_thread_mutex);
+	if (--event_thread_refs == 0)
+		stop_event_thread();
+	pthread_mutex_unlock(&event_thread_mutex);
+}
+
+/* Set up the transfer object and make the first submission. Further
+   submissions are made from inside read_callback(). */
+static int start_reading(hid_device *dev)
+{
+	int i;
+	const size_t length = dev->input_ep_max_packet_size;
+
+#ifdef __linux__
+	/* Not fatal if it fails, hid_get_fd() then returns -1. */
+	if (dev->event_fd < 0)
+		dev->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+
+	dev->num_transfers = read_transfer_count;
+	dev->transfer_buffer = malloc(length * dev->num_transfers);
+	if (!dev->transfer_buffer && length > 0)
+		return -1;
+
+	for (i = 0; i < dev->num_transfers; i++) {
+		dev->transfers[i] = libusb_alloc_transfer(0);
+		if (!dev->transfers[i])
+			goto err;
+		libusb_fill_interrupt_transfer(dev->transfers[i],
+			dev->device_handle,
+			dev->input_endpoint,
+			dev->transfer_buffer + i * length,
+			length,
+			read_callback,
+			dev,
+			5000/*timeout*/);
+	}
+
+	if (acquire_event_thread() < 0)
+		goto err;
+
+	/* Transfers on the same endpoint complete in the order they were
+	   submitted, so reports reach the queue in order. Carry on with
+	   fewer transfers if some of them can't be submitted. */
+	pthread_mutex_lock(&dev->mutex);
+	for (i = 0; i < dev->num_transfers; i++) {
+		if (libusb_submit_transfer(dev->transfers[i]) < 0)
+			break;
+		dev->transfers_in_flight++;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (dev->transfers_in_flight == 0) {
+		release_event_thread();
+		goto err;
+	}
+
+	return 0;
+
+err:
+	for (i = 0; i < dev->num_transfers; i++) {
+		libusb_free_transfer(dev->transfers[i]);
+		dev->transfers[i] = NULL;
+	}
+	free(dev->transfer_buffer);
+	dev->transfer_buffer = NULL;
+	return -1;
+}
+
+/* Cancel all of the device's transfers. These calls will fail for
+   transfers which are not pending, but that's OK. */
+static void cancel_transfers(hid_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
+}
+
+/* Stop and clean up the transfers set up by start_reading(). */
+static void finish_reading(hid_device *dev)
+{
+	int i;
+
+	/* Cause read_callback() to stop re-submitting, and cancel the
+	   transfers in case they are in flight. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->shutdown_reading = 1;
+	pthread_mutex_unlock(&dev->mutex);
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_refs == 1) {
+		/* This is the last open device. Ask the event thread to
+		   stop before cancelling, so the cancellation wakes it,
+		   then deliver any remaining callbacks from this thread. */
+		event_thread_refs = 0;
+		event_thread_shutdown = 1;
+		cancel_transfers(dev);
+		stop_event_thread();
+		while (!dev->cancelled)
+			libusb_handle_events_completed(usb_context, &dev->cancelled);
+		pthread_mutex_unlock(&event_thread_mutex);
+	}
+	else {
+		pthread_mutex_unlock(&event_thread_mutex);
+		cancel_transfers(dev);
+
+		/* Wait for the event thread to deliver the final callbacks
+		   before dropping this device's reference on it. */
+		pthread_mutex_lock(&dev->mutex);
+		while (!dev->cancelled)
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		pthread_mutex_unlock(&dev->mutex);
+
+		release_event_thread();
+	}
+
+	/* Clean up the Transfer objects allocated in start_reading(). */
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_free_transfer(dev->transfers[i]);
+	free(dev->transfer_buffer);
+}
+
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_flags(path, 0);
+}
+
+/* Open usb_dev and claim the HID interface described by intf_desc.
+   Returns 1 on success, 0 if the device has gone away, and -1 if it
+   could not be opened. */
+static int open_interface(hid_device *dev, libusb_device *usb_dev,
+                          const struct libusb_device_descriptor *desc,
+                          const struct libusb_interface_descriptor *intf_desc)
+{
+	int i;
+	int res;
+
+	res = libusb_open(usb_dev, &dev->device_handle);
+	if (res < 0) {
+		LOG("can't open device\n");
+		return (res == LIBUSB_ERROR_NO_DEVICE)? 0: -1;
+	}
+#ifdef DETACH_KERNEL_DRIVER
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+		if (res < 0) {
+			libusb_close(dev->device_handle);
+			LOG("Unable to detach Kernel Driver\n");
+			return -1;
+		}
+		dev->is_driver_detached = 1;
+	}
+#endif
+	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+		libusb_close(dev->device_handle);
+		return -1;
+	}
+
+	/* Store off the string descriptor indexes */
+	dev->manufacturer_index = desc->iManufacturer;
+	dev->product_index      = desc->iProduct;
+	dev->serial_index       = desc->iSerialNumber;
+
+	/* Store off the interface number */
+	dev->interface = intf_desc->bInterfaceNumber;
+
+	/* Find the INPUT and OUTPUT endpoints. An
+	   OUTPUT endpoint is not required. */
+	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep
+			= &intf_desc->endpoint[i];
+
+		/* Determine the type and direction of this
+		   endpoint. */
+		int is_interrupt =
+			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		int is_output =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_OUT;
+		int is_input =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_IN;
+
+		/* Decide whether to use it for input or output. */
+		if (dev->input_endpoint == 0 &&
+		    is_interrupt && is_input) {
+			/* Use this endpoint for INPUT */
+			dev->input_endpoint = ep->bEndpointAddress;
+			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		}
+		if (dev->output_endpoint == 0 &&
+		    is_interrupt && is_output) {
+			/* Use this endpoint for OUTPUT */
+			dev->output_endpoint = ep->bEndpointAddress;
+		}
+	}
+
+	if (alloc_input_reports(dev) < 0) {
+		LOG("can't allocate input reports\n");
+		libusb_release_interface(dev->device_handle, dev->interface);
+		libusb_close(dev->device_handle);
+		return -1;
+	}
+
+	if (!dev->synchronous && start_reading(dev) < 0) {
+		LOG("can't start reading\n");
+		libusb_release_interface(dev->device_handle, dev->interface);
+		libusb_close(dev->device_handle);
+		return -1;
+	}
+
+	/* Start with the strings read while enumerating. */
+	port_cache_load(usb_dev, &dev->string_cache);
+
+	return 1;
+}
+
+/* Open the HID interface of usb_dev whose path is path. Returns 1 on
+   success, 0 if usb_dev has no such interface or has gone away, and
+   -1 if the interface was found but could not be opened. */
+static int open_device_path(hid_device *dev, libusb_device *usb_dev, const char *path)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int j, k;
+	int res = 0;
+
+	libusb_get_device_descriptor(usb_dev, &desc);
+
+	if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+		return 0;
+	for (j = 0; j < conf_desc->bNumInterfaces && res == 0; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting && res == 0; k++) {
+			const struct libusb_interface_descriptor *intf_desc;
+			intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID &&
+			    path_matches(usb_dev, intf_desc->bInterfaceNumber, path)) {
+				/* Matched Paths. Open this device */
+				res = open_interface(dev, usb_dev, &desc, intf_desc);
+				if (res > 0)
+					dev->path = strdup(path);
+			}
+		}
+	}
+	libusb_free_config_descriptor(conf_desc);
+
+	return res;
+}
+
+/* Handles closed with HID_OPEN_KEEP_CLAIMED, which still have their
+   interface claimed and can be handed out again by hid_open_path(). */
+static hid_device *claimed_devices = NULL;
+static pthread_mutex_t claimed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Release the interface and free a handle whose reading has stopped. */
+static void release_device(hid_device *dev)
+{
+	/* release the interface */
+	libusb_release_interface(dev->device_handle, dev->interface);
+
+#ifdef DETACH_KERNEL_DRIVER
+	/* Give the interface back to the kernel driver */
+	if (dev->is_driver_detached) {
+		int res = libusb_attach_kernel_driver(dev->device_handle, dev->interface);
+		if (res < 0)
+			LOG("Failed to reattach the driver to kernel.\n");
+	}
+#endif
+
+	/* Close the handle */
+	libusb_close(dev->device_handle);
+
+	/* The input report slots are freed along with the device. */
+	free_hid_device(dev);
+}
+
+/* Take the kept handle for path out of the list, or return NULL. If
+   path is NULL, take the first one. */
+static hid_device *take_claimed(const char *path)
+{
+	hid_device **link;
+	hid_device *dev = NULL;
+
+	pthread_mutex_lock(&claimed_mutex);
+	for (link = &claimed_devices; *link; link = &(*link)->next_claimed) {
+		if (!path || !strcmp((*link)->path, path)) {
+			dev = *link;
+			*link = dev->next_claimed;
+			dev->next_claimed = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&claimed_mutex);
+
+	return dev;
+}
+
+/* Get a kept handle ready to be used again with the given flags. */
+static hid_device *reopen_claimed(const char *path, int flags)
+{
+	hid_device *dev = take_claimed(path);
+	if (!dev)
+		return NULL;
+
+	dev->synchronous = (flags & HID_OPEN_NO_READ_THREAD) != 0;
+	dev->keep_claimed = (flags & HID_OPEN_KEEP_CLAIMED) != 0;
+	dev->blocking = 1;
+	dev->shutdown_reading = 0;
+	dev->cancelled = 0;
+	dev->transfers_in_flight = 0;
+	reset_input_reports(dev);
+	set_event_fd(dev, 0);
+	memset(&dev->errors, 0, sizeof(dev->errors));
+	dev->last_error_str[0] = L'\0';
+
+	if (!dev->synchronous && start_reading(dev) < 0) {
+		release_device(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+hid_device * HID_API_EXPORT hid_open_path_flags(const char *path, int flags)
+{
+	hid_device *dev = NULL;
+
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	int d = 0;
+	int good_open = 0;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	/* Use the handle kept from an earlier hid_close(), if there is one. */
+	dev = reopen_claimed(path, flags);
+	if (dev)
+		return dev;
+
+	dev = new_hid_device();
+	dev->synchronous = (flags & HID_OPEN_NO_READ_THREAD) != 0;
+	dev->keep_claimed = (flags & HID_OPEN_KEEP_CLAIMED) != 0;
+
+	/* Try the device hid_enumerate() last saw at this path. */
+	usb_dev = path_index_find(path);
+	if (usb_dev) {
+		good_open = open_device_path(dev, usb_dev, path);
+		libusb_unref_device(usb_dev);
+
+		/* The index is stale, forget this path. */
+		if (good_open == 0)
+			path_index_remove(path);
+	}
+
+	/* Otherwise look for the path on the whole bus. */
+	if (good_open == 0) {
+		libusb_get_device_list(usb_context, &devs);
+		while (good_open == 0 && (usb_dev = devs[d++]) != NULL)
+			good_open = open_device_path(dev, usb_dev, path);
+		libusb_free_device_list(devs, 1);
+	}
+
+	/* If we have a good handle, return it. */
+	if (good_open > 0) {
+		return dev;
+	}
+	else {
+		/* Unable to open any devices. */
+		free_hid_device(dev);
+		return NULL;
+	}
+}
+
+/* Number of threads hid_open_paths_flags() opens devices with. */
+#define OPEN_PATHS_THREADS 8
+
+/* Shared by the threads of hid_open_paths_flags(). usb_devs[i] is the
+   device found for paths[i], or NULL, and each thread takes the next
+   index to open until all have been tried. */
+struct open_paths_batch {
+	const char **paths;
+	libusb_device **usb_devs;
+	hid_device **out;
+	size_t n;
+	size_t next;
+	int flags;
+	pthread_mutex_t mutex;
+};
+
+static void *open_paths_thread(void *param)
+{
+	struct open_paths_batch *batch = param;
 
-	while (!dev->cancelled)
-		libusb_handle_events_completed(usb_context, &dev->cancelled);
+	while (1) {
+		hid_device *dev;
+		size_t i;
 
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+		pthread_mutex_lock(&batch->mutex);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+		if (i >= batch->n)
+			break;
+		if (!batch->usb_devs[i])
+			continue;
+
+		dev = new_hid_device();
+		dev->synchronous = (batch->flags & HID_OPEN_NO_READ_THREAD) != 0;
+		dev->keep_claimed = (batch->flags & HID_OPEN_KEEP_CLAIMED) != 0;
+		if (open_device_path(dev, batch->usb_devs[i], batch->paths[i]) > 0)
+			batch->out[i] = dev;
+		else
+			free_hid_device(dev);
+	}
 
 	return NULL;
 }
 
-
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+int HID_API_EXPORT hid_open_paths(const char **paths, size_t n, hid_device **out)
 {
-	hid_device *dev = NULL;
+	return hid_open_paths_flags(paths, n, out, 0);
+}
 
+int HID_API_EXPORT hid_open_paths_flags(const char **paths, size_t n, hid_device **out, int flags)
+{
+	struct open_paths_batch batch;
+	pthread_t threads[OPEN_PATHS_THREADS];
 	libusb_device **devs;
 	libusb_device *usb_dev;
-	int res;
-	int d = 0;
-	int good_open = 0;
+	char *duplicate;
+	size_t i, j, unresolved = 0;
+	int num_threads, t;
+	int opened = 0;
 
-	if(hid_init() < 0)
-		return NULL;
-
-	dev = new_hid_device();
+	for (i = 0; i < n; i++)
+		out[i] = NULL;
 
-	libusb_get_device_list(usb_context, &devs);
-	while ((usb_dev = devs[d++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
-		libusb_get_device_descriptor(usb_dev, &desc);
+	if (n == 0)
+		return 0;
 
-		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
-			continue;
-		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-			const struct libusb_interface *intf = &conf_desc->interface[j];
-			for (k = 0; k < intf->num_altsetting; k++) {
-				const struct libusb_interface_descriptor *intf_desc;
-				intf_desc = &intf->altsetting[k];
-				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
-					if (!strcmp(dev_path, path)) {
-						/* Matched Paths. Open this device */
-
-						/* OPEN HERE */
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
-							break;
-						}
-						good_open = 1;
-#ifdef DETACH_KERNEL_DRIVER
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-#endif
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
-						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-							free(dev_path);
-							libusb_close(dev->device_handle);
-							good_open = 0;
-							break;
-						}
+	if (hid_init() < 0)
+		return -1;
 
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for input or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
-						}
+	batch.usb_devs = calloc(n, sizeof(libusb_device *));
+	duplicate = calloc(n, 1);
+	if (!batch.usb_devs || !duplicate) {
+		free(batch.usb_devs);
+		free(duplicate);
+		return -1;
+	}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
+	/* A path given again is left unopened, as its device can only be
+	   claimed once. */
+	for (i = 1; i < n; i++) {
+		for (j = 0; j < i && !duplicate[i]; j++)
+			duplicate[i] = !strcmp(paths[i], paths[j]);
+	}
 
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
+	/* Use kept handles, or find the devices hid_enumerate() last saw
+	   at these paths. */
+	for (i = 0; i < n; i++) {
+		if (duplicate[i])
+			continue;
+		out[i] = reopen_claimed(paths[i], flags);
+		if (out[i])
+			continue;
+		batch.usb_devs[i] = path_index_find(paths[i]);
+		if (!batch.usb_devs[i])
+			unresolved++;
+	}
 
+	/* Look for the rest with a single walk of the bus, reading the
+	   descriptors of only the devices a path could name. */
+	if (unresolved > 0 && libusb_get_device_list(usb_context, &devs) >= 0) {
+		int d = 0;
+		while (unresolved > 0 && (usb_dev = devs[d++]) != NULL) {
+			struct libusb_config_descriptor *conf_desc = NULL;
+			int candidate = 0;
+			int k, l;
+
+			for (i = 0; i < n && !candidate; i++) {
+				candidate = !duplicate[i] && !batch.usb_devs[i] && !out[i] &&
+					path_names_device(usb_dev, paths[i]);
+			}
+			if (!candidate)
+				continue;
+
+			if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+				continue;
+			for (k = 0; k < conf_desc->bNumInterfaces; k++) {
+				const struct libusb_interface *intf = &conf_desc->interface[k];
+				for (l = 0; l < intf->num_altsetting; l++) {
+					const struct libusb_interface_descriptor *intf_desc;
+					intf_desc = &intf->altsetting[l];
+					if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+						continue;
+					for (i = 0; i < n; i++) {
+						if (!duplicate[i] && !batch.usb_devs[i] && !out[i] &&
+						    path_matches(usb_dev, intf_desc->bInterfaceNumber, paths[i])) {
+							batch.usb_devs[i] = libusb_ref_device(usb_dev);
+							unresolved--;
+						}
 					}
-					free(dev_path);
 				}
 			}
+			libusb_free_config_descriptor(conf_desc);
 		}
-		libusb_free_config_descriptor(conf_desc);
+		libusb_free_device_list(devs, 1);
+	}
 
+	/* Opening and claiming is mostly waiting on the kernel and the
+	   devices, so open several at once. */
+	batch.paths = paths;
+	batch.out = out;
+	batch.n = n;
+	batch.next = 0;
+	batch.flags = flags;
+	pthread_mutex_init(&batch.mutex, NULL);
+
+	num_threads = (n < OPEN_PATHS_THREADS)? n: OPEN_PATHS_THREADS;
+	for (t = 0; t < num_threads; t++) {
+		if (pthread_create(&threads[t], NULL, open_paths_thread, &batch) != 0)
+			break;
 	}
+	num_threads = t;
 
-	libusb_free_device_list(devs, 1);
+	/* Finish on this thread if none could be started. */
+	if (num_threads == 0)
+		open_paths_thread(&batch);
 
-	/* If we have a good handle, return it. */
-	if (good_open) {
-		return dev;
-	}
-	else {
-		/* Unable to open any devices. */
-		free_hid_device(dev);
-		return NULL;
+	for (t = 0; t < num_threads; t++)
+		pthread_join(threads[t], NULL);
+
+	pthread_mutex_destroy(&batch.mutex);
+
+	for (i = 0; i < n; i++) {
+		if (batch.usb_devs[i]) {
+			libusb_unref_device(batch.usb_devs[i]);
+
+			/* The index may have been stale, so look the path up
+			   again the long way. */
+			if (!out[i]) {
+				path_index_remove(paths[i]);
+				out[i] = hid_open_path_flags(paths[i], flags);
+			}
+		}
+		if (out[i])
+			opened++;
 	}
+
+	free(batch.usb_devs);
+	free(duplicate);
+
+	return opened;
 }
 
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+static int write_timeout(hid_device *dev, const unsigned char *data, size_t length, unsigned int timeout)
 {
 	int res;
 	int report_number = data[0];
@@ -1021,10 +2405,12 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			(2/*HID output*/ << 8) | report_number,
 			dev->interface,
 			(unsigned char *)data, length,
-			1000/*timeout millis*/);
+			timeout);
 
-		if (res < 0)
+		if (res < 0) {
+			register_error(dev, "hid_write", res);
 			return -1;
+		}
 
 		if (skipped_report_id)
 			length++;
@@ -1038,10 +2424,12 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			dev->output_endpoint,
 			(unsigned char*)data,
 			length,
-			&actual_length, 1000);
+			&actual_length, timeout);
 
-		if (res < 0)
+		if (res < 0) {
+			register_error(dev, "hid_write", res);
 			return -1;
+		}
 
 		if (skipped_report_id)
 			actual_length++;
@@ -1050,22 +2438,233 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	return write_timeout(dev, data, length, 1000/*timeout millis*/);
+}
+
+/* State of one hid_write_async() call, freed by write_callback(). */
+struct write_request {
+	hid_device *dev;
+	hid_write_callback callback;
+	void *user_data;
+	int skipped_report_id;
+};
+
+static void write_callback(struct libusb_transfer *transfer)
+{
+	struct write_request *req = transfer->user_data;
+	hid_device *dev = req->dev;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		res = transfer->actual_length;
+		if (req->skipped_report_id)
+			res++;
+	}
+	else {
+		LOG("Asynchronous write failed with status %d\n", transfer->status);
+		register_error(dev, "hid_write_async", transfer_error(transfer->status));
+	}
+
+	if (req->callback)
+		req->callback(dev, res, req->user_data);
+	free(req);
+
+	/* The transfer and its buffer are freed by libusb on return
+	   (LIBUSB_TRANSFER_FREE_TRANSFER). hid_close() may free dev as
+	   soon as the count reaches 0, so don't touch it after that. */
+	pthread_mutex_lock(&dev->mutex);
+	if (--dev->writes_in_flight == 0)
+		pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	struct libusb_transfer *transfer;
+	struct write_request *req;
+	unsigned char *buf;
+	int res;
+	int report_number = data[0];
+	int skipped_report_id = 0;
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	/* Completions are delivered by the event thread. Devices which
+	   aren't reading don't hold it, so take it until hid_close(). */
+	if (dev->synchronous && !dev->write_event_thread) {
+		if (acquire_event_thread() < 0)
+			return -1;
+		dev->write_event_thread = 1;
+	}
+
+	req = malloc(sizeof(*req));
+	transfer = libusb_alloc_transfer(0);
+	if (dev->output_endpoint <= 0)
+		buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+	else
+		buf = malloc(length > 0? length: 1);
+	if (!req || !transfer || !buf) {
+		free(req);
+		libusb_free_transfer(transfer);
+		free(buf);
+		return -1;
+	}
+
+	req->dev = dev;
+	req->callback = callback;
+	req->user_data = user_data;
+	req->skipped_report_id = skipped_report_id;
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrupt out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(buf,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			length);
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+		libusb_fill_control_transfer(transfer, dev->device_handle, buf,
+			write_callback, req, 1000/*timeout millis*/);
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		memcpy(buf, data, length);
+		libusb_fill_interrupt_transfer(transfer, dev->device_handle,
+			dev->output_endpoint, buf, length,
+			write_callback, req, 1000/*timeout millis*/);
+	}
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	pthread_mutex_lock(&dev->mutex);
+	res = libusb_submit_transfer(transfer);
+	if (res < 0) {
+		pthread_mutex_unlock(&dev->mutex);
+		libusb_free_transfer(transfer);
+		free(req);
+		register_error(dev, "hid_write_async", res);
+		return -1;
+	}
+	dev->writes_in_flight++;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+/* Empty the queue and give each slot its own part of input_report_buffer again. */
+static void reset_input_reports(hid_device *dev)
+{
+	int i;
+	size_t size = dev->input_ep_max_packet_size;
+
+	/* read_callback() swaps slot and transfer buffers, so this is
+	   needed whenever the transfers are replaced. */
+	for (i = 0; i < INPUT_REPORT_QUEUE_SIZE; i++) {
+		dev->input_reports[i].data = dev->input_report_buffer + i * size;
+		dev->input_reports[i].len = 0;
+	}
+	dev->spare_report = dev->input_report_buffer + INPUT_REPORT_QUEUE_SIZE * size;
+	dev->lent_report = NULL;
+	dev->input_report_head = 0;
+	dev->input_report_count = 0;
+}
+
+/* Allocate one data buffer of the input endpoint's maximum packet
+   size for every slot in the input report ring, and one spare for
+   hid_read_borrow(). */
+static int alloc_input_reports(hid_device *dev)
+{
+	size_t size = dev->input_ep_max_packet_size;
+
+	dev->input_report_buffer = malloc(size * (INPUT_REPORT_QUEUE_SIZE + 1));
+	if (!dev->input_report_buffer && size > 0)
+		return -1;
+
+	reset_input_reports(dev);
+
+	return 0;
+}
+
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the oldest slot (rpt) into the return
+	   buffer (data), and release the slot. */
+	struct input_report *rpt = &dev->input_reports[dev->input_report_head];
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	dev->input_report_head = (dev->input_report_head + 1) % INPUT_REPORT_QUEUE_SIZE;
+	dev->input_report_count--;
+	if (dev->input_report_count == 0 && !dev->shutdown_reading)
+		set_event_fd(dev, 0);
 	return len;
 }
 
+/* Read an input report with a synchronous interrupt transfer. This
+   replaces the report queue for devices opened with
+   HID_OPEN_NO_READ_THREAD. */
+static int read_synchronous(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	int res;
+	int transferred = 0;
+	unsigned char *buf = data;
+	size_t buf_len = length;
+	unsigned int timeout;
+
+	if (dev->shutdown_reading)
+		return -1;
+
+	/* A libusb timeout of 0 means wait forever, so a non-blocking
+	   read polls for the shortest time possible instead. */
+	if (milliseconds < 0)
+		timeout = 0;
+	else if (milliseconds == 0)
+		timeout = 1;
+	else
+		timeout = milliseconds;
+
+	/* Read into a full-size slot if the caller's buffer is shorter
+	   than a packet, so that a long report doesn't overflow. */
+	if (length < (size_t)dev->input_ep_max_packet_size) {
+		buf = dev->input_reports[0].data;
+		buf_len = dev->input_ep_max_packet_size;
+	}
+
+	res = libusb_interrupt_transfer(dev->device_handle,
+		dev->input_endpoint,
+		buf,
+		buf_len,
+		&transferred, timeout);
+
+	if (res == LIBUSB_ERROR_TIMEOUT)
+		return 0;
+
+	if (res == LIBUSB_ERROR_NO_DEVICE)
+		dev->shutdown_reading = 1;
+
+	if (res < 0) {
+		LOG("libusb_interrupt_transfer() failed with %d\n", res);
+		register_error(dev, "hid_read", res);
+		return -1;
+	}
+
+	if (buf != data) {
+		if ((size_t)transferred > length)
+			transferred = length;
+		memcpy(data, buf, transferred);
+	}
+
+	return transferred;
+}
+
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
@@ -1073,48 +2672,31 @@ static void cleanup_mutex(void *param)
 }
 
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Wait, with dev->mutex held, for an input report to be queued.
+   Returns 1 once one is, 0 on timeout and -1 if reading has stopped. */
+static int wait_for_report(hid_device *dev, int milliseconds)
 {
-	int bytes_read = -1;
-
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
-
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	/* There's an input report queued up. */
+	if (dev->input_report_count > 0)
+		return 1;
 
-	if (dev->shutdown_thread) {
+	if (dev->shutdown_reading) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->input_report_count && !dev->shutdown_reading) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
 	}
 	else if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
 		int res;
 		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
 		ts.tv_sec += milliseconds / 1000;
 		ts.tv_nsec += (milliseconds % 1000) * 1000000;
 		if (ts.tv_nsec >= 1000000000L) {
@@ -1122,45 +2704,178 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
+		while (!dev->input_report_count && !dev->shutdown_reading) {
+			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
+			/* If res is 0, there was a spurious wake up or the
+			   read thread was shutdown. Run the loop again. */
+			if (res == ETIMEDOUT)
+				return 0; /* Timed out. */
+			else if (res != 0)
+				return -1; /* Error. */
+		}
+	}
+	else {
+		/* Purely non-blocking */
+		return 0;
+	}
+
+	return dev->input_report_count? 1: -1;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	int bytes_read;
+
+	if (dev->synchronous)
+		return read_synchronous(dev, data, length, milliseconds);
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	bytes_read = wait_for_report(dev, milliseconds);
+	if (bytes_read > 0) {
+		/* Return the first one */
+		bytes_read = return_data(dev, data, length);
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_borrow(hid_device *dev, const unsigned char **data, int milliseconds)
+{
+	int bytes_read;
+
+	if (dev->synchronous)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	if (dev->lent_report) {
+		/* The last report hasn't been released. */
+		bytes_read = -1;
+	}
+	else {
+		bytes_read = wait_for_report(dev, milliseconds);
+		if (bytes_read > 0) {
+			/* Lend out the first slot's buffer and put the spare
+			   in its place, so the ring never holds the lent
+			   buffer however the queue moves until it is
+			   released. Then dequeue the slot. */
+			struct input_report *rpt = &dev->input_reports[dev->input_report_head];
+			*data = rpt->data;
+			bytes_read = rpt->len;
+			dev->lent_report = rpt->data;
+			rpt->data = dev->spare_report;
+			dev->spare_report = NULL;
+			return_data(dev, NULL, 0);
+		}
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return bytes_read;
+}
+
+void HID_API_EXPORT hid_release_report(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->lent_report) {
+		/* The lent buffer becomes the spare. */
+		dev->spare_report = dev->lent_report;
+		dev->lent_report = NULL;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+/* Milliseconds left until the CLOCK_MONOTONIC time deadline, or 0 if it
+   has passed. */
+static int remaining_ms(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+	     (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return (ms > 0)? ms: 0;
+}
+
+/* Discard reports which arrived before a request, so that an old
+   response, such as a late reply to a request which timed out, can't
+   be taken for the answer to it. Synchronous devices leave unread
+   reports on the device, so read them out with the shortest timeout.
+   A device which never stops sending is given up on after as many
+   reports as the queue holds. */
+static void discard_input_reports(hid_device *dev)
+{
+	unsigned char report;
+	int i;
 
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
-				/* Timed out. */
-				bytes_read = 0;
-				break;
-			}
-			else {
-				/* Error. */
-				bytes_read = -1;
+	if (dev->synchronous) {
+		for (i = 0; i < INPUT_REPORT_QUEUE_SIZE; i++) {
+			if (read_synchronous(dev, &report, sizeof(report), 0) <= 0)
 				break;
-			}
 		}
-	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+		return;
 	}
 
-ret:
+	pthread_mutex_lock(&dev->mutex);
+	while (dev->input_report_count > 0)
+		return_data(dev, NULL, 0);
 	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+}
 
-	return bytes_read;
+void HID_API_EXPORT hid_discard_input(hid_device *dev)
+{
+	discard_input_reports(dev);
 }
 
-int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT hid_transact(hid_device *dev, const unsigned char *request, size_t request_length, unsigned char *response, size_t response_length, int milliseconds)
 {
-	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+	struct timespec deadline;
+	int timeout;
+	int res;
+
+	discard_input_reports(dev);
+
+	if (milliseconds < 0) {
+		/* No deadline. A libusb timeout of 0 waits forever. */
+		if (write_timeout(dev, request, request_length, 0) < 0)
+			return -1;
+		return hid_read_timeout(dev, response, response_length, -1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += milliseconds / 1000;
+	deadline.tv_nsec += (milliseconds % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	/* The write and the read share what is left of the deadline. */
+	timeout = remaining_ms(&deadline);
+	if (write_timeout(dev, request, request_length, (timeout > 0)? timeout: 1) < 0)
+		return -1;
+
+	res = hid_read_timeout(dev, response, response_length, remaining_ms(&deadline));
+
+	/* Unlike a plain read, a missing response is a failure. */
+	if (res == 0)
+		register_error(dev, "hid_transact", LIBUSB_ERROR_TIMEOUT);
+
+	return res;
 }
 
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
@@ -1191,8 +2906,10 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_error(dev, "hid_send_feature_report", res);
 		return -1;
+	}
 
 	/* Account for the report ID */
 	if (skipped_report_id)
@@ -1222,8 +2939,10 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_error(dev, "hid_get_feature_report", res);
 		return -1;
+	}
 
 	if (skipped_report_id)
 		res++;
@@ -1237,31 +2956,40 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	/* Let writes from hid_write_async() complete, which takes at
+	   most their timeout. */
+	pthread_mutex_lock(&dev->mutex);
+	while (dev->writes_in_flight > 0)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	if (dev->write_event_thread) {
+		release_event_thread();
+		dev->write_event_thread = 0;
+	}
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Stop the transfer allocated in start_reading(). */
+	if (!dev->synchronous)
+		finish_reading(dev);
 
-	/* release the interface */
-	libusb_release_interface(dev->device_handle, dev->interface);
+	/* Keep the interface claimed for the next hid_open_path(). */
+	if (dev->keep_claimed && dev->path) {
+		pthread_mutex_lock(&claimed_mutex);
+		dev->next_claimed = claimed_devices;
+		claimed_devices = dev;
+		pthread_mutex_unlock(&claimed_mutex);
+		return;
+	}
 
-	/* Close the handle */
-	libusb_close(dev->device_handle);
+	release_device(dev);
+}
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
+void HID_API_EXPORT hid_release_claimed(const char *path)
+{
+	hid_device *dev;
 
-	free_hid_device(dev);
+	while ((dev = take_claimed(path)) != NULL)
+		release_device(dev);
 }
 
 
@@ -1284,7 +3012,7 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 {
 	wchar_t *str;
 
-	str = get_usb_string(dev->device_handle, string_index);
+	str = get_usb_string(dev->device_handle, &dev->string_cache, string_index);
 	if (str) {
 		wcsncpy(string, str, maxlen);
 		string[maxlen-1] = L'\0';
@@ -1298,7 +3026,80 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	return NULL;
+	/* Only device errors are recorded. */
+	if (!dev || dev->last_error_str[0] == L'\0')
+		return NULL;
+
+	return dev->last_error_str;
+}
+
+int HID_API_EXPORT hid_set_read_transfer_count(int count)
+{
+	if (count < 1 || count > HID_MAX_READ_TRANSFERS)
+		return -1;
+
+	read_transfer_count = count;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_read_transfer_count(void)
+{
+	return read_transfer_count;
+}
+
+int HID_API_EXPORT hid_set_path_scheme(int scheme)
+{
+	if (scheme != HID_PATH_BY_ADDRESS && scheme != HID_PATH_BY_PORT)
+		return -1;
+
+	path_scheme = scheme;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_queue_policy(hid_device *dev, int policy)
+{
+	if (policy != HID_QUEUE_DROP_OLDEST && policy != HID_QUEUE_DROP_NEWEST)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->queue_policy = policy;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_queue_stats(hid_device *dev, struct hid_queue_stats *stats)
+{
+	if (!stats)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	stats->capacity = INPUT_REPORT_QUEUE_SIZE;
+	stats->queued = dev->input_report_count;
+	stats->high_water_mark = dev->queue_high_water_mark;
+	stats->overflows = dev->queue_overflows;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_error_stats(hid_device *dev, struct hid_error_stats *stats)
+{
+	if (!stats)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	*stats = dev->errors;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_fd(hid_device *dev)
+{
+	return dev->event_fd;
 }
 
 
@@ -1308,10 +3109,12 @@ struct lang_map_entry {
 	uint16_t usb_code;
 };
 
+/* Sorted by string code, so get_usb_code_for_current_locale() can use a
+   binary search. Where a code appears more than once, the first entry
+   is the one used. */
 #define LANG(name,code,usb_code) { name, code, usb_code }
-static struct lang_map_entry lang_map[] = {
+static const struct lang_map_entry lang_map[] = {
 	LANG("Afrikaans", "af", 0x0436),
-	LANG("Albanian", "sq", 0x041C),
 	LANG("Arabic - United Arab Emirates", "ar_ae", 0x3801),
 	LANG("Arabic - Bahrain", "ar_bh", 0x3C01),
 	LANG("Arabic - Algeria", "ar_dz", 0x1401),
@@ -1328,113 +3131,109 @@ static struct lang_map_entry lang_map[] = {
 	LANG("Arabic - Syria", "ar_sy", 0x2801),
 	LANG("Arabic - Tunisia", "ar_tn", 0x1C01),
 	LANG("Arabic - Yemen", "ar_ye", 0x2401),
-	LANG("Armenian", "hy", 0x042B),
 	LANG("Azeri - Latin", "az_az", 0x042C),
 	LANG("Azeri - Cyrillic", "az_az", 0x082C),
-	LANG("Basque", "eu", 0x042D),
 	LANG("Belarusian", "be", 0x0423),
 	LANG("Bulgarian", "bg", 0x0402),
 	LANG("Catalan", "ca", 0x0403),
-	LANG("Chinese - China", "zh_cn", 0x0804),
-	LANG("Chinese - Hong Kong SAR", "zh_hk", 0x0C04),
-	LANG("Chinese - Macau SAR", "zh_mo", 0x1404),
-	LANG("Chinese - Singapore", "zh_sg", 0x1004),
-	LANG("Chinese - Taiwan", "zh_tw", 0x0404),
-	LANG("Croatian", "hr", 0x041A),
 	LANG("Czech", "cs", 0x0405),
 	LANG("Danish", "da", 0x0406),
-	LANG("Dutch - Netherlands", "nl_nl", 0x0413),
-	LANG("Dutch - Belgium", "nl_be", 0x0813),
+	LANG("German - Austria", "de_at", 0x0C07),
+	LANG("German - Switzerland", "de_ch", 0x0807),
+	LANG("German - Germany", "de_de", 0x0407),
+	LANG("German - Liechtenstein", "de_li", 0x1407),
+	LANG("German - Luxembourg", "de_lu", 0x1007),
+	LANG("Greek", "el", 0x0408),
 	LANG("English - Australia", "en_au", 0x0C09),
 	LANG("English - Belize", "en_bz", 0x2809),
 	LANG("English - Canada", "en_ca", 0x1009),
 	LANG("English - Caribbean", "en_cb", 0x2409),
+	LANG("English - Great Britain", "en_gb", 0x0809),
 	LANG("English - Ireland", "en_ie", 0x1809),
 	LANG("English - Jamaica", "en_jm", 0x2009),
 	LANG("English - New Zealand", "en_nz", 0x1409),
 	LANG("English - Phillippines", "en_ph", 0x3409),
-	LANG("English - Southern Africa", "en_za", 0x1C09),
 	LANG("English - Trinidad", "en_tt", 0x2C09),
-	LANG("English - Great Britain", "en_gb", 0x0809),
 	LANG("English - United States", "en_us", 0x0409),
+	LANG("English - Southern Africa", "en_za", 0x1C09),
+	LANG("Spanish - Argentina", "es_ar", 0x2C0A),
+	LANG("Spanish - Bolivia", "es_bo", 0x400A),
+	LANG("Spanish - Chile", "es_cl", 0x340A),
+	LANG("Spanish - Colombia", "es_co", 0x240A),
+	LANG("Spanish - Costa Rica", "es_cr", 0x140A),
+	LANG("Spanish - Dominican Republic", "es_do", 0x1C0A),
+	LANG("Spanish - Ecuador", "es_ec", 0x300A),
+	LANG("Spanish - Spain (Traditional)", "es_es", 0x040A),
+	LANG("Spanish - Guatemala", "es_gt", 0x100A),
+	LANG("Spanish - Honduras", "es_hn", 0x480A),
+	LANG("Spanish - Mexico", "es_mx", 0x080A),
+	LANG("Spanish - Nicaragua", "es_ni", 0x4C0A),
+	LANG("Spanish - Panama", "es_pa", 0x180A),
+	LANG("Spanish - Peru", "es_pe", 0x280A),
+	LANG("Spanish - Puerto Rico", "es_pr", 0x500A),
+	LANG("Spanish - Paraguay", "es_py", 0x3C0A),
+	LANG("Spanish - El Salvador", "es_sv", 0x440A),
+	LANG("Spanish - Uruguay", "es_uy", 0x380A),
+	LANG("Spanish - Venezuela", "es_ve", 0x200A),
 	LANG("Estonian", "et", 0x0425),
+	LANG("Basque", "eu", 0x042D),
 	LANG("Farsi", "fa", 0x0429),
 	LANG("Finnish", "fi", 0x040B),
 	LANG("Faroese", "fo", 0x0438),
-	LANG("French - France", "fr_fr", 0x040C),
 	LANG("French - Belgium", "fr_be", 0x080C),
 	LANG("French - Canada", "fr_ca", 0x0C0C),
-	LANG("French - Luxembourg", "fr_lu", 0x140C),
 	LANG("French - Switzerland", "fr_ch", 0x100C),
-	LANG("Gaelic - Ireland", "gd_ie", 0x083C),
+	LANG("French - France", "fr_fr", 0x040C),
+	LANG("French - Luxembourg", "fr_lu", 0x140C),
 	LANG("Gaelic - Scotland", "gd", 0x043C),
-	LANG("German - Germany", "de_de", 0x0407),
-	LANG("German - Austria", "de_at", 0x0C07),
-	LANG("German - Liechtenstein", "de_li", 0x1407),
-	LANG("German - Luxembourg", "de_lu", 0x1007),
-	LANG("German - Switzerland", "de_ch", 0x0807),
-	LANG("Greek", "el", 0x0408),
+	LANG("Gaelic - Ireland", "gd_ie", 0x083C),
 	LANG("Hebrew", "he", 0x040D),
 	LANG("Hindi", "hi", 0x0439),
+	LANG("Croatian", "hr", 0x041A),
 	LANG("Hungarian", "hu", 0x040E),
-	LANG("Icelandic", "is", 0x040F),
+	LANG("Armenian", "hy", 0x042B),
 	LANG("Indonesian", "id", 0x0421),
-	LANG("Italian - Italy", "it_it", 0x0410),
+	LANG("Icelandic", "is", 0x040F),
 	LANG("Italian - Switzerland", "it_ch", 0x0810),
+	LANG("Italian - Italy", "it_it", 0x0410),
 	LANG("Japanese", "ja", 0x0411),
 	LANG("Korean", "ko", 0x0412),
-	LANG("Latvian", "lv", 0x0426),
 	LANG("Lithuanian", "lt", 0x0427),
+	LANG("Latvian", "lv", 0x0426),
 	LANG("F.Y.R.O. Macedonia", "mk", 0x042F),
-	LANG("Malay - Malaysia", "ms_my", 0x043E),
+	LANG("Marathi", "mr", 0x044E),
 	LANG("Malay – Brunei", "ms_bn", 0x083E),
+	LANG("Malay - Malaysia", "ms_my", 0x043E),
 	LANG("Maltese", "mt", 0x043A),
-	LANG("Marathi", "mr", 0x044E),
+	LANG("Dutch - Belgium", "nl_be", 0x0813),
+	LANG("Dutch - Netherlands", "nl_nl", 0x0413),
 	LANG("Norwegian - Bokml", "no_no", 0x0414),
 	LANG("Norwegian - Nynorsk", "no_no", 0x0814),
 	LANG("Polish", "pl", 0x0415),
-	LANG("Portuguese - Portugal", "pt_pt", 0x0816),
 	LANG("Portuguese - Brazil", "pt_br", 0x0416),
+	LANG("Portuguese - Portugal", "pt_pt", 0x0816),
 	LANG("Raeto-Romance", "rm", 0x0417),
 	LANG("Romanian - Romania", "ro", 0x0418),
 	LANG("Romanian - Republic of Moldova", "ro_mo", 0x0818),
 	LANG("Russian", "ru", 0x0419),
 	LANG("Russian - Republic of Moldova", "ru_mo", 0x0819),
 	LANG("Sanskrit", "sa", 0x044F),
+	LANG("Sorbian", "sb", 0x042E),
+	LANG("Slovak", "sk", 0x041B),
+	LANG("Slovenian", "sl", 0x0424),
+	LANG("Albanian", "sq", 0x041C),
 	LANG("Serbian - Cyrillic", "sr_sp", 0x0C1A),
 	LANG("Serbian - Latin", "sr_sp", 0x081A),
-	LANG("Setsuana", "tn", 0x0432),
-	LANG("Slovenian", "sl", 0x0424),
-	LANG("Slovak", "sk", 0x041B),
-	LANG("Sorbian", "sb", 0x042E),
-	LANG("Spanish - Spain (Traditional)", "es_es", 0x040A),
-	LANG("Spanish - Argentina", "es_ar", 0x2C0A),
-	LANG("Spanish - Bolivia", "es_bo", 0x400A),
-	LANG("Spanish - Chile", "es_cl", 0x340A),
-	LANG("Spanish - Colombia", "es_co", 0x240A),
-	LANG("Spanish - Costa Rica", "es_cr", 0x140A),
-	LANG("Spanish - Dominican Republic", "es_do", 0x1C0A),
-	LANG("Spanish - Ecuador", "es_ec", 0x300A),
-	LANG("Spanish - Guatemala", "es_gt", 0x100A),
-	LANG("Spanish - Honduras", "es_hn", 0x480A),
-	LANG("Spanish - Mexico", "es_mx", 0x080A),
-	LANG("Spanish - Nicaragua", "es_ni", 0x4C0A),
-	LANG("Spanish - Panama", "es_pa", 0x180A),
-	LANG("Spanish - Peru", "es_pe", 0x280A),
-	LANG("Spanish - Puerto Rico", "es_pr", 0x500A),
-	LANG("Spanish - Paraguay", "es_py", 0x3C0A),
-	LANG("Spanish - El Salvador", "es_sv", 0x440A),
-	LANG("Spanish - Uruguay", "es_uy", 0x380A),
-	LANG("Spanish - Venezuela", "es_ve", 0x200A),
 	LANG("Southern Sotho", "st", 0x0430),
-	LANG("Swahili", "sw", 0x0441),
-	LANG("Swedish - Sweden", "sv_se", 0x041D),
 	LANG("Swedish - Finland", "sv_fi", 0x081D),
+	LANG("Swedish - Sweden", "sv_se", 0x041D),
+	LANG("Swahili", "sw", 0x0441),
 	LANG("Tamil", "ta", 0x0449),
-	LANG("Tatar", "tt", 0X0444),
 	LANG("Thai", "th", 0x041E),
+	LANG("Setsuana", "tn", 0x0432),
 	LANG("Turkish", "tr", 0x041F),
 	LANG("Tsonga", "ts", 0x0431),
+	LANG("Tatar", "tt", 0X0444),
 	LANG("Ukrainian", "uk", 0x0422),
 	LANG("Urdu", "ur", 0x0420),
 	LANG("Uzbek - Cyrillic", "uz_uz", 0x0843),
@@ -1442,23 +3241,51 @@ static struct lang_map_entry lang_map[] = {
 	LANG("Vietnamese", "vi", 0x042A),
 	LANG("Xhosa", "xh", 0x0434),
 	LANG("Yiddish", "yi", 0x043D),
+	LANG("Chinese - China", "zh_cn", 0x0804),
+	LANG("Chinese - Hong Kong SAR", "zh_hk", 0x0C04),
+	LANG("Chinese - Macau SAR", "zh_mo", 0x1404),
+	LANG("Chinese - Singapore", "zh_sg", 0x1004),
+	LANG("Chinese - Taiwan", "zh_tw", 0x0404),
 	LANG("Zulu", "zu", 0x0435),
-	LANG(NULL, NULL, 0x0),
 };
 
-uint16_t get_usb_code_for_current_locale(void)
+#define LANG_MAP_SIZE (sizeof(lang_map) / sizeof(lang_map[0]))
+
+/* The last locale looked up and the LANGID found for it */
+static pthread_mutex_t locale_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char cached_locale[64];
+static uint16_t cached_usb_code;
+static int cached_locale_valid = 0;
+
+/* Return the index of the lang_map entry whose string code is code,
+   or -1 if there is none. */
+static int find_lang_map_entry(const char *code)
+{
+	size_t lo = 0;
+	size_t hi = LANG_MAP_SIZE;
+
+	/* Find the first entry which doesn't sort before code. */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (strcmp(lang_map[mid].string_code, code) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < LANG_MAP_SIZE && !strcmp(lang_map[lo].string_code, code))
+		return lo;
+
+	return -1;
+}
+
+static uint16_t lookup_usb_code(const char *locale)
 {
-	char *locale;
 	char search_string[64];
 	char *ptr;
-	struct lang_map_entry *lang;
-
-	/* Get the current locale. */
-	locale = setlocale(0, NULL);
-	if (!locale)
-		return 0x0;
+	int i;
 
-	/* Make a copy of the current locale string. */
+	/* Make a copy of the locale string. */
 	strncpy(search_string, locale, sizeof(search_string));
 	search_string[sizeof(search_string)-1] = '\0';
 
@@ -1474,41 +3301,51 @@ uint16_t get_usb_code_for_current_locale(void)
 	}
 
 	/* Find the entry which matches the string code of our locale. */
-	lang = lang_map;
-	while (lang->string_code) {
-		if (!strcmp(lang->string_code, search_string)) {
-			return lang->usb_code;
-		}
-		lang++;
-	}
+	i = find_lang_map_entry(search_string);
+	if (i >= 0)
+		return lang_map[i].usb_code;
 
 	/* There was no match. Find with just the language only. */
 	/* Chop off the variant. Chop it off at the '_'. */
-	ptr = search_string;
-	while (*ptr) {
-		*ptr = tolower(*ptr);
-		if (*ptr == '_') {
-			*ptr = '\0';
-			break;
-		}
-		ptr++;
-	}
-
-#if 0 /* TODO: Do we need this? */
-	/* Find the entry which matches the string code of our language. */
-	lang = lang_map;
-	while (lang->string_code) {
-		if (!strcmp(lang->string_code, search_string)) {
-			return lang->usb_code;
-		}
-		lang++;
+	ptr = strchr(search_string, '_');
+	if (ptr) {
+		*ptr = '\0';
+
+		/* Find the entry which matches the string code of our language. */
+		i = find_lang_map_entry(search_string);
+		if (i >= 0)
+			return lang_map[i].usb_code;
 	}
-#endif
 
 	/* Found nothing. */
 	return 0x0;
 }
 
+/* The LANGID is only looked up again when the locale has changed. */
+uint16_t get_usb_code_for_current_locale(void)
+{
+	char *locale;
+	uint16_t usb_code;
+
+	/* Get the current locale. */
+	locale = setlocale(0, NULL);
+	if (!locale)
+		return 0x0;
+
+	pthread_mutex_lock(&locale_mutex);
+	if (!cached_locale_valid ||
+	    strncmp(cached_locale, locale, sizeof(cached_locale) - 1) != 0) {
+		strncpy(cached_locale, locale, sizeof(cached_locale));
+		cached_locale[sizeof(cached_locale)-1] = '\0';
+		cached_usb_code = lookup_usb_code(cached_locale);
+		cached_locale_valid = 1;
+	}
+	usb_code = cached_usb_code;
+	pthread_mutex_unlock(&locale_mutex);
+
+	return usb_code;
+}
+
 #ifdef __cplusplus
 }
 #endif
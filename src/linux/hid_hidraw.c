@@ -0,0 +1,531 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Alan Ott
+ Signal 11 Software
+
+ 8/22/2009
+ Linux Version - 6/2/2010
+
+ Copyright 2009, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
+
+/* This is the hidraw implementation of the HIDAPI interface. It talks
+   to the kernel HID driver through /dev/hidrawN instead of detaching it
+   and claiming the interface through libusb, so any number of programs
+   can have the same device open at once. Device information is read
+   from sysfs, so no libusb or libudev is required. Build it in place
+   of hid.c with HIDAPI_HIDRAW defined. */
+
+#define _GNU_SOURCE /* needed for wcsdup() before glibc 2.10 */
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <locale.h>
+#include <errno.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <wchar.h>
+
+/* Linux */
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SYSFS_HIDRAW_CLASS "/sys/class/hidraw"
+
+struct hid_device_ {
+	int device_handle;
+	int blocking;
+
+	/* Strings read from sysfs when the device was opened. */
+	struct hid_device_info *info;
+};
+
+static hid_device *new_hid_device(void)
+{
+	hid_device *dev = calloc(1, sizeof(hid_device));
+	if (!dev)
+		return NULL;
+
+	dev->device_handle = -1;
+	dev->blocking = 1;
+
+	return dev;
+}
+
+static wchar_t *utf8_to_wchar(const char *text, size_t len)
+{
+	size_t i = 0, j = 0;
+	wchar_t *str = malloc((len + 1) * sizeof(wchar_t));
+	if (!str)
+		return NULL;
+
+	while (i < len) {
+		unsigned char c = text[i++];
+		uint32_t code;
+		int extra;
+
+		if (c < 0x80) {
+			code = c;
+			extra = 0;
+		}
+		else if ((c & 0xE0) == 0xC0) {
+			code = c & 0x1F;
+			extra = 1;
+		}
+		else if ((c & 0xF0) == 0xE0) {
+			code = c & 0x0F;
+			extra = 2;
+		}
+		else if ((c & 0xF8) == 0xF0) {
+			code = c & 0x07;
+			extra = 3;
+		}
+		else {
+			code = 0xFFFD;
+			extra = 0;
+		}
+
+		while (extra > 0 && i < len && (text[i] & 0xC0) == 0x80) {
+			code = (code << 6) | (text[i++] & 0x3F);
+			extra--;
+		}
+		if (extra > 0)
+			code = 0xFFFD;
+
+		str[j++] = code;
+	}
+	str[j] = 0x00000000;
+
+	return str;
+}
+
+/* Read a sysfs attribute of the directory dir into buf, stripping the
+   trailing newline. Returns the length, or -1 if it can't be read. */
+static int read_sysfs_attr(const char *dir, const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	int fd;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\0'))
+		len--;
+	buf[len] = '\0';
+
+	return len;
+}
+
+static wchar_t *get_sysfs_string(const char *dir, const char *attr)
+{
+	char buf[512];
+	int len = read_sysfs_attr(dir, attr, buf, sizeof(buf));
+	if (len < 0)
+		return NULL;
+	return utf8_to_wchar(buf, len);
+}
+
+/* Find KEY=value in the contents of a uevent file. Returns a pointer to
+   the value, which runs to the next newline, or NULL. */
+static const char *find_uevent_value(const char *uevent, const char *key)
+{
+	size_t key_len = strlen(key);
+	const char *line = uevent;
+
+	while (line && *line) {
+		if (strncmp(line, key, key_len) == 0 && line[key_len] == '=')
+			return line + key_len + 1;
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return NULL;
+}
+
+static wchar_t *get_uevent_string(const char *uevent, const char *key)
+{
+	const char *value = find_uevent_value(uevent, key);
+	if (!value)
+		return NULL;
+	return utf8_to_wchar(value, strcspn(value, "\n"));
+}
+
+/* Strip the last component from a sysfs path in place. */
+static int parent_dir(char *dir)
+{
+	char *slash = strrchr(dir, '/');
+	if (!slash || slash == dir)
+		return -1;
+	*slash = '\0';
+	return 0;
+}
+
+/* Fill in everything but the path and the link of info for the hidraw
+   node called name (e.g. "hidraw3"). The HID device's uevent gives the
+   bus and IDs. For USB devices, its parent is the USB interface and the
+   grandparent the USB device, which hold the interface number, release
+   and the strings the kernel read at enumeration. */
+static int get_hidraw_info(const char *name, struct hid_device_info *info)
+{
+	char link[PATH_MAX];
+	char dir[PATH_MAX];
+	char uevent[1024];
+	char buf[64];
+	unsigned int bus, vendor_id, product_id;
+	const char *value;
+
+	memset(info, 0, sizeof(*info));
+	info->interface_number = -1;
+
+	snprintf(link, sizeof(link), SYSFS_HIDRAW_CLASS "/%s/device", name);
+	if (!realpath(link, dir))
+		return -1;
+
+	if (read_sysfs_attr(dir, "uevent", uevent, sizeof(uevent)) < 0)
+		return -1;
+
+	value = find_uevent_value(uevent, "HID_ID");
+	if (!value || sscanf(value, "%x:%x:%x", &bus, &vendor_id, &product_id) != 3)
+		return -1;
+
+	info->vendor_id = vendor_id;
+	info->product_id = product_id;
+
+	if (bus != BUS_USB) {
+		/* Not a USB device. The kernel still knows its name and the
+		   unique ID, which Bluetooth and I2C devices use as a serial. */
+		info->serial_number = get_uevent_string(uevent, "HID_UNIQ");
+		info->product_string = get_uevent_string(uevent, "HID_NAME");
+		return 0;
+	}
+
+	/* USB interface */
+	if (parent_dir(dir) < 0)
+		return 0;
+	if (read_sysfs_attr(dir, "bInterfaceNumber", buf, sizeof(buf)) > 0)
+		info->interface_number = strtol(buf, NULL, 16);
+
+	/* USB device */
+	if (parent_dir(dir) < 0)
+		return 0;
+	if (read_sysfs_attr(dir, "bcdDevice", buf, sizeof(buf)) > 0)
+		info->release_number = strtol(buf, NULL, 16);
+
+	info->serial_number = get_sysfs_string(dir, "serial");
+	info->manufacturer_string = get_sysfs_string(dir, "manufacturer");
+	info->product_string = get_sysfs_string(dir, "product");
+
+	return 0;
+}
+
+static void free_hid_device_info(struct hid_device_info *info)
+{
+	if (!info)
+		return;
+	free(info->path);
+	free(info->serial_number);
+	free(info->manufacturer_string);
+	free(info->product_string);
+	free(info);
+}
+
+/* Return the hidraw node name from a path like /dev/hidraw3. */
+static const char *hidraw_name(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	return name ? name + 1 : path;
+}
+
+int HID_API_EXPORT hid_init(void)
+{
+	const char *locale;
+
+	/* Set the locale if it's not set. */
+	locale = setlocale(LC_CTYPE, NULL);
+	if (!locale)
+		setlocale(LC_CTYPE, "");
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	/* Nothing to do for this in the hidraw implementation. */
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	if (hid_init() < 0)
+		return NULL;
+
+	dir = opendir(SYSFS_HIDRAW_CLASS);
+	if (!dir)
+		return NULL;
+
+	while ((entry = readdir(dir)) != NULL) {
+		struct hid_device_info *tmp;
+		char path[PATH_MAX];
+
+		if (strncmp(entry->d_name, "hidraw", 6) != 0)
+			continue;
+
+		tmp = malloc(sizeof(struct hid_device_info));
+		if (!tmp)
+			break;
+
+		if (get_hidraw_info(entry->d_name, tmp) < 0 ||
+		    (vendor_id != 0x0 && vendor_id != tmp->vendor_id) ||
+		    (product_id != 0x0 && product_id != tmp->product_id)) {
+			free_hid_device_info(tmp);
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+		tmp->path = strdup(path);
+
+		if (cur_dev)
+			cur_dev->next = tmp;
+		else
+			root = tmp;
+		cur_dev = tmp;
+	}
+
+	closedir(dir);
+
+	return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free_hid_device_info(d);
+		d = next;
+	}
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	cur_dev = devs;
+	while (cur_dev) {
+		if (cur_dev->vendor_id == vendor_id &&
+		    cur_dev->product_id == product_id) {
+			if (serial_number) {
+				if (cur_dev->serial_number &&
+				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
+					path_to_open = cur_dev->path;
+					break;
+				}
+			}
+			else {
+				path_to_open = cur_dev->path;
+				break;
+			}
+		}
+		cur_dev = cur_dev->next;
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+	}
+
+	hid_free_enumeration(devs);
+
+	return handle;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	struct hidraw_devinfo raw_info;
+	hid_device *dev;
+
+	if (hid_init() < 0)
+		return NULL;
+
+	dev = new_hid_device();
+	if (!dev)
+		return NULL;
+
+	dev->device_handle = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->device_handle < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	/* Make sure this really is a hidraw node. */
+	if (ioctl(dev->device_handle, HIDIOCGRAWINFO, &raw_info) < 0) {
+		close(dev->device_handle);
+		free(dev);
+		return NULL;
+	}
+
+	dev->info = malloc(sizeof(struct hid_device_info));
+	if (dev->info && get_hidraw_info(hidraw_name(path), dev->info) < 0) {
+		free_hid_device_info(dev->info);
+		dev->info = NULL;
+	}
+
+	return dev;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	/* hidraw takes the report ID as the first byte and strips it
+	   itself when it is zero, which is what HIDAPI callers pass. */
+	return write(dev->device_handle, data, length);
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	ssize_t bytes_read;
+	struct pollfd fds;
+	int ret;
+
+	/* Always poll first, as the fd is blocking. A timeout of -1
+	   waits forever and 0 returns at once. */
+	fds.fd = dev->device_handle;
+	fds.events = POLLIN;
+	fds.revents = 0;
+
+	do {
+		ret = poll(&fds, 1, milliseconds);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0)
+		return ret; /* Error or timeout */
+
+	if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -1; /* Device was unplugged */
+
+	if (!(fds.revents & POLLIN))
+		return 0;
+
+	bytes_read = read(dev->device_handle, data, length);
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EINPROGRESS))
+		bytes_read = 0;
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	dev->blocking = !nonblock;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	return ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	return ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+	if (!dev)
+		return;
+
+	close(dev->device_handle);
+	free_hid_device_info(dev->info);
+	free(dev);
+}
+
+static int copy_string(const wchar_t *src, wchar_t *string, size_t maxlen)
+{
+	if (!src || maxlen == 0)
+		return -1;
+
+	wcsncpy(string, src, maxlen);
+	string[maxlen-1] = L'\0';
+
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return copy_string(dev->info ? dev->info->manufacturer_string : NULL, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return copy_string(dev->info ? dev->info->product_string : NULL, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return copy_string(dev->info ? dev->info->serial_number : NULL, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+	/* hidraw gives no access to arbitrary string descriptors. */
+	return -1;
+}
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+	return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,488 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Alan Ott
+ Signal 11 Software
+
+ Copyright 2009, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
+
+/** @file
+ * @defgroup API hidapi API
+
+ * Extensions specific to the libusb implementation.
+ */
+
+#ifndef HIDAPI_LIBUSB_H__
+#define HIDAPI_LIBUSB_H__
+
+#include "hidapi.h"
+
+/** Maximum number of interrupt IN transfers kept in flight per device. */
+#define HID_MAX_READ_TRANSFERS 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+		/** Flags for hid_open_path_flags() and hid_open_paths_flags(). */
+		enum hid_open_flags {
+			/** Read input reports with synchronous interrupt
+			    transfers in hid_read_timeout() instead of
+			    queueing them from the event thread. */
+			HID_OPEN_NO_READ_THREAD = 0x01,
+			/** Keep the interface claimed, and the kernel driver
+			    detached, when the device is closed. The next
+			    hid_open_path() of the same path gets the handle
+			    back without opening and claiming the device
+			    again. See hid_release_claimed(). */
+			HID_OPEN_KEEP_CLAIMED = 0x02
+		};
+
+		/** Fields of #hid_device_info for hid_enumerate_fields() to fill in. */
+		enum hid_device_info_fields {
+			/** The serial_number string */
+			HID_INFO_SERIAL_NUMBER = 0x01,
+			/** The manufacturer_string string */
+			HID_INFO_MANUFACTURER_STRING = 0x02,
+			/** The product_string string */
+			HID_INFO_PRODUCT_STRING = 0x04,
+			/** All of the strings, as hid_enumerate() does */
+			HID_INFO_ALL_STRINGS = 0x07
+		};
+
+		/** @brief Enumerate the HID Devices, filling in only some fields.
+
+			Behaves as hid_enumerate(), but only reads the strings
+			selected by fields and leaves the others NULL. The path,
+			IDs, release and interface number are always filled in.
+			Devices are usually opened only to read their strings,
+			so asking for fewer strings, or none, makes enumeration
+			cheaper. A string left out can be read later from an
+			open device with hid_get_serial_number_string() and
+			friends.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the types of device
+				to open.
+			@param product_id The Product ID (PID) of the types of
+				device to open.
+			@param fields A combination of #hid_device_info_fields,
+				or 0 for none of the strings.
+
+			@returns
+				This function returns a pointer to a linked list of type
+				struct #hid_device_info, containing information about
+				the HID devices attached to the system, or NULL in the
+				case of failure. Free this linked list by calling
+				hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_fields(unsigned short vendor_id, unsigned short product_id, int fields);
+
+		/** @brief Open a HID device by its path name with options.
+
+			Behaves as hid_open_path(). With HID_OPEN_NO_READ_THREAD
+			no transfer is kept in flight on the INTERRUPT IN
+			endpoint and the shared event thread is not used.
+			Reports are only received while a call to
+			hid_read_timeout() or hid_read() is waiting, which suits
+			single request/response exchanges.
+
+			@ingroup API
+			@param path The path name of the device to open
+			@param flags A combination of #hid_open_flags.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_flags(const char *path, int flags);
+
+		/** @brief Open several HID devices by their path names.
+
+			Behaves as calling hid_open_path() for each path, but
+			finds all the devices with a single walk of the bus and
+			opens them from several threads at once. A device can
+			only be claimed once, so a path which is given more
+			than once is opened for its first entry only.
+
+			@ingroup API
+			@param paths The path names of the devices to open.
+			@param n The number of paths.
+			@param out Array of n handles. out[i] is set to the
+				handle for paths[i], or NULL if it couldn't be
+				opened or paths[i] repeats an earlier path.
+
+			@returns
+				This function returns the number of devices opened,
+				or -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_open_paths(const char **paths, size_t n, hid_device **out);
+
+		/** @brief Open several HID devices by their path names with options.
+
+			Behaves as hid_open_paths(), with the flags of
+			hid_open_path_flags() applied to every device.
+
+			@ingroup API
+			@param paths The path names of the devices to open.
+			@param n The number of paths.
+			@param out Array of n handles, set as for hid_open_paths().
+			@param flags A combination of #hid_open_flags.
+
+			@returns
+				This function returns the number of devices opened,
+				or -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_open_paths_flags(const char **paths, size_t n, hid_device **out, int flags);
+
+		/** @brief Release handles kept by HID_OPEN_KEEP_CLAIMED.
+
+			Releases the interface of, reattaches the kernel driver
+			to, and closes devices which were opened with
+			HID_OPEN_KEEP_CLAIMED and have since been passed to
+			hid_close(). hid_exit() releases all of them, so a
+			program which keeps handles should call it before it
+			exits.
+
+			@ingroup API
+			@param path The path of the device to release, or NULL
+				to release all of them.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_release_claimed(const char *path);
+
+		/** @brief Change the number of interrupt IN transfers kept in
+			flight by all further calls to hid_open() or hid_open_path().
+
+			Each transfer has its own buffer, so reports which
+			arrive while another report is being queued are not
+			held back until the next poll interval. Reports are
+			queued in the order they arrive. Devices opened with
+			HID_OPEN_NO_READ_THREAD are not affected.
+
+			@ingroup API
+			@param count The number of transfers, from 1 (the
+				default) to #HID_MAX_READ_TRANSFERS.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_read_transfer_count(int count);
+
+		/** @brief Getter for the option set by hid_set_read_transfer_count().
+
+			@ingroup API
+			@returns
+				The number of transfers kept in flight per device.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_read_transfer_count(void);
+
+		/** How the path of a device is formed. */
+		enum hid_path_scheme {
+			/** Bus number, device address and interface number,
+			    as in 0001:0005:00. The address changes each time
+			    the device is plugged in. */
+			HID_PATH_BY_ADDRESS = 0,
+			/** Bus number, port chain and interface number, as in
+			    1-4.2:00. This stays the same as long as the device
+			    is plugged into the same port. */
+			HID_PATH_BY_PORT = 1
+		};
+
+		/** @brief Choose how hid_enumerate() forms device paths.
+
+			Paths by port let a caller keep state about a device
+			across enumerations and re-plugs. hid_open_path()
+			accepts paths in either scheme, whatever is set here.
+			Devices without a known port chain, such as root hubs,
+			are always named by address.
+
+			@ingroup API
+			@param scheme One of #hid_path_scheme. The default is
+				#HID_PATH_BY_ADDRESS.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_path_scheme(int scheme);
+
+		/** @brief Callback for the completion of hid_write_async().
+
+			Called on the libusb event thread, so it should return
+			quickly and must not close the device.
+
+			@ingroup API
+			@param device The device written to.
+			@param result The number of bytes written, as returned
+				by hid_write(), or -1 on error.
+			@param user_data The pointer passed to hid_write_async().
+		*/
+		typedef void (HID_API_CALL *hid_write_callback)(hid_device *device, int result, void *user_data);
+
+		/** @brief Write an Output report without waiting for it to be sent.
+
+			Behaves as hid_write(), but returns once the transfer has
+			been submitted. The data is copied, so the buffer can be
+			reused straight away. Writes to any number of devices can
+			be outstanding at once, including several to one device,
+			which are sent in order. hid_close() waits for a device's
+			outstanding writes, each of which times out after 1000
+			milliseconds.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, including the report number
+				as the first byte.
+			@param length The length in bytes of the data to send.
+			@param callback Called when the write completes, or NULL.
+			@param user_data Passed to callback.
+
+			@returns
+				This function returns 0 if the write was submitted
+				and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *device, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data);
+
+		/** @brief Callback for changes to the device registry.
+
+			@ingroup API
+			@param info The record of the device interface which
+				was attached or detached. It is only valid for
+				the duration of the call.
+			@param attached 1 if the device was attached, 0 if it
+				was detached.
+			@param user_data The pointer passed to hid_registry_start().
+		*/
+		typedef void (HID_API_CALL *hid_registry_callback)(const struct hid_device_info *info, int attached, void *user_data);
+
+		/** @brief Start keeping a registry of attached devices.
+
+			The registry is a table of the HID devices matching
+			@p vendor_id and @p product_id, with their paths and
+			strings, which is kept up to date by libusb hotplug
+			events. While it is running, hid_enumerate() calls
+			which it covers return a copy of the table instead of
+			scanning the bus and opening each device.
+
+			This function returns once the devices which are
+			already attached have been added. The callback is
+			called from the registry's own thread as devices are
+			attached and detached.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) to track, or 0 for any.
+			@param product_id The Product ID (PID) to track, or 0 for any.
+			@param callback The function to notify of changes (Optionally NULL).
+			@param user_data The pointer to pass to @p callback.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				including when libusb does not support hotplug on
+				this platform or the registry is already running.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_registry_start(unsigned short vendor_id, unsigned short product_id, hid_registry_callback callback, void *user_data);
+
+		/** @brief Stop keeping the registry of attached devices.
+
+			hid_enumerate() scans the bus again after this call.
+			hid_exit() calls this function.
+
+			@ingroup API
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_registry_stop(void);
+
+		/** Input report queue overflow policies, see hid_set_queue_policy(). */
+		enum hid_queue_policy {
+			/** Discard the oldest queued report to make room (default). */
+			HID_QUEUE_DROP_OLDEST = 0,
+			/** Discard the report which has just arrived. */
+			HID_QUEUE_DROP_NEWEST = 1
+		};
+
+		/** Input report queue statistics, see hid_get_queue_stats(). */
+		struct hid_queue_stats {
+			/** Number of report slots in the queue */
+			unsigned int capacity;
+			/** Number of reports currently waiting to be read */
+			unsigned int queued;
+			/** Largest number of reports which have been queued at once */
+			unsigned int high_water_mark;
+			/** Number of reports discarded because the queue was full */
+			unsigned long overflows;
+		};
+
+		/** @brief Set what happens when the input report queue is full.
+
+			Input reports are held in a fixed size queue until they
+			are read. When a report arrives and the queue is full,
+			either the oldest queued report or the new report is
+			discarded.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param policy HID_QUEUE_DROP_OLDEST or HID_QUEUE_DROP_NEWEST.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_queue_policy(hid_device *device, int policy);
+
+		/** @brief Get the input report queue statistics of a HID device.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats The structure to fill in.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_queue_stats(hid_device *device, struct hid_queue_stats *stats);
+
+		/** Device error statistics, see hid_get_error_stats(). */
+		struct hid_error_stats {
+			/** Last libusb error code (enum libusb_error), 0 if none */
+			int last_error;
+			/** Number of writes and control transfers which timed
+			    out, and hid_transact() calls which got no response
+			    before the deadline. Idle input transfers timing out
+			    are not counted. */
+			unsigned long timeouts;
+			/** Number of transfers which the device stalled */
+			unsigned long stalls;
+			/** Number of transfers which failed because the device
+			    was gone */
+			unsigned long no_device;
+			/** Number of input transfers which couldn't be
+			    submitted again, which stops reading */
+			unsigned long resubmit_failures;
+		};
+
+		/** @brief Get the error statistics of a device.
+
+			Every failed libusb call on the device is counted and
+			becomes the last error, which hid_error() describes.
+			Timeouts suggest a slow or busy bus where a retry may
+			succeed, while no_device means the device has gone and
+			should be skipped. The statistics start again when a
+			handle kept by HID_OPEN_KEEP_CLAIMED is reopened.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats The statistics are copied here.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_error_stats(hid_device *device, struct hid_error_stats *stats);
+
+		/** @brief Get a file descriptor to wait on for input reports.
+
+			The descriptor can be added to poll(), select() or epoll
+			so one thread can wait on many devices. It is readable
+			while input reports are queued and after the device has
+			stopped reading, for example because it was unplugged.
+			It stays readable until the queue has been emptied with
+			hid_read_timeout() and a timeout of 0, which never
+			blocks. Do not read from or close the descriptor.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the file descriptor, or -1
+				if the device was opened with
+				HID_OPEN_NO_READ_THREAD or it could not be
+				created.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_fd(hid_device *device);
+
+		/** @brief Send an Output report and wait for the response.
+
+			Any input reports already queued, or waiting on the
+			device for a handle opened with HID_OPEN_NO_READ_THREAD,
+			are discarded first, so the response returned is the
+			first report to arrive after the request was sent. Writing the request and
+			waiting for the response share a single deadline on the
+			monotonic clock, which is not affected by changes to the
+			system time.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param request The Output report to send, starting with
+				the Report ID as for hid_write().
+			@param request_length The length in bytes of request.
+			@param response A buffer to put the response into.
+			@param response_length The size of the response buffer.
+			@param milliseconds Time allowed for the whole
+				transaction, or -1 to wait indefinitely.
+
+			@returns
+				This function returns the number of bytes read
+				into response, 0 if no response arrived before the
+				deadline, or -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_transact(hid_device *device, const unsigned char *request, size_t request_length, unsigned char *response, size_t response_length, int milliseconds);
+
+		/** @brief Discard the Input reports received so far.
+
+			Empties the queue, or for a device opened with
+			HID_OPEN_NO_READ_THREAD reads out the reports waiting
+			on the device, as hid_transact() does before sending.
+			Call it before hid_write_async() when the response is
+			read with hid_read_timeout(), so that a late reply to
+			an earlier request isn't taken for the new one.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_discard_input(hid_device *device);
+
+		/** @brief Read an Input report without copying it.
+
+			Like hid_read_timeout(), but instead of copying the
+			report into a caller's buffer, data is pointed at the
+			buffer holding it. The buffer is taken out of the queue
+			and lent to the caller, and is not reused until
+			hid_release_report() is called, which must be done
+			before borrowing the next report. Reports received
+			meanwhile are queued as usual.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data Set to the report data, which stays valid
+				until hid_release_report() or hid_close().
+			@param milliseconds timeout in milliseconds or -1 for
+				blocking wait.
+
+			@returns
+				This function returns the number of bytes in the
+				report, 0 if no report was available within the
+				timeout, or -1 on error, including when the
+				previous report has not been released or the
+				device was opened with HID_OPEN_NO_READ_THREAD.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_borrow(hid_device *device, const unsigned char **data, int milliseconds);
+
+		/** @brief Return a report borrowed with hid_read_borrow().
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_release_report(hid_device *device);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
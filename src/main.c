@@ -4,15 +4,49 @@
  * April 2024
  *****************************************************************************/
 
+/* Expose POSIX socket and signal functions and SO_PEERCRED when building with -std=c99 */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* Unix builds can run as a daemon serving commands over a UNIX domain socket */
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DAEMON_SUPPORTED
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include "hidapi.h"
 
+/* Linux builds use the libusb backend unless the hidraw backend is selected */
+
+#if defined(__linux__) && !defined(HIDAPI_HIDRAW)
+#define HIDAPI_LIBUSB
+#include "hidapi_libusb.h"
+#endif
+
 /* Debug constant */
 
 #define DEBUG                                   false
@@ -24,9 +58,30 @@
 
 #define ARGUMENT_BUFFER_SIZE                    1024
 #define SERIAL_NUMBER_BUFFER_SIZE               1024
+#define ERROR_BUFFER_SIZE                       128
 
 #define MAXIMUM_NUMBER_OF_DEVICES               256
 
+/* Worker constants */
+
+#define MAXIMUM_NUMBER_OF_WORKERS               64
+
+/* Session constants */
+
+#define MAXIMUM_NUMBER_OF_STEPS                 16
+
+/* Command line constants for batch and daemon requests */
+
+#define COMMAND_LINE_SIZE                       4096
+#define MAXIMUM_NUMBER_OF_ARGUMENTS             512
+
+/* Daemon constants */
+
+#define DAEMON_SOCKET_NAME                      "audiomoth-usb-microphone"
+#define DAEMON_REQUEST_TIMEOUT                  5
+#define DAEMON_BACKLOG                          16
+#define DAEMON_STATUS_MARKER                    '#'
+
 /* Configuration constants */
 
 #define NUMBER_OF_SAMPLE_RATES                  8
@@ -55,6 +110,9 @@
 #define AUDIOMOTH_USB_VID                       0x16D0
 #define AUDIOMOTH_USB_PID                       0x06F3
 
+#define USB_READ_TIMEOUT                        100
+#define USB_TRANSACTION_TIMEOUT                 1100
+
 /* Filter type enum */
 
 typedef enum {NO_FILTER, LOW_PASS_FILTER, BAND_PASS_FILTER, HIGH_PASS_FILTER} filterType_t;
@@ -109,19 +167,81 @@ static configSettings_t defaultConfigSettings = {
     .disableLED = 0
 };
 
-/* USB buffers */
+/* Step data structure holding one operation of a session and its settings */
 
-static uint8_t usbInputBuffer[USB_PACKETSIZE];
+typedef struct {
+    operationType_t operationType;
+    filterType_t filterType;
+    configSettings_t configSettings;
+} step_t;
 
-static uint8_t usbOutputBuffer[USB_PACKETSIZE];
+#ifdef HIDAPI_LIBUSB
 
-/* Serial number buffer */
+/* Write group data structure counting the asynchronous writes of one worker still to complete */
 
-static char parsedSerialNumbers[MAXIMUM_NUMBER_OF_DEVICES][USB_SERIAL_NUMBER_LENGTH + 1];
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    int numberOfPendingWrites;
+} writeGroup_t;
+
+#endif
+
+/* Task data structure holding the buffers for one device so that devices can be handled in parallel */
+
+typedef struct {
+    char *path;
+    char deviceID[USB_SERIAL_NUMBER_LENGTH + 1];
+    uint8_t usbInputBuffers[MAXIMUM_NUMBER_OF_STEPS][USB_PACKETSIZE];
+    uint8_t usbOutputBuffer[USB_PACKETSIZE];
+    char communicationError[2 * ERROR_BUFFER_SIZE];
+    int numberOfCompletedSteps;
+    double openTime;
+    double stepTimes[MAXIMUM_NUMBER_OF_STEPS];
+#ifdef HIDAPI_LIBUSB
+    hid_device *device;
+    writeGroup_t *writeGroup;
+    int writeResult;
+    double writeTime;
+#endif
+} task_t;
+
+/* Worker data structure */
+
+typedef struct {
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+    task_t *tasks;
+    int firstTask;
+    int numberOfTasks;
+    int numberOfWorkers;
+    step_t *steps;
+    int numberOfSteps;
+} worker_t;
+
+/* Device ID hash table data structures */
+
+typedef struct {
+    char deviceID[USB_SERIAL_NUMBER_LENGTH + 1];
+    char *path;
+    bool used;
+} deviceEntry_t;
+
+typedef struct {
+    deviceEntry_t *entries;
+    uint32_t mask;
+} deviceTable_t;
+
+/* Operation names */
 
-static char currentSerialNumber[SERIAL_NUMBER_BUFFER_SIZE];
+static char *operationStrings[] = {"CONFIG", "UPDATE", "LED", "RESTORE", "READ", "PERSIST", "FIRMWARE", "BOOTLOADER"};
 
-static wchar_t currentWideSerialNumber[SERIAL_NUMBER_BUFFER_SIZE];
+/* Serial number buffer */
+
+static char parsedSerialNumbers[MAXIMUM_NUMBER_OF_DEVICES][USB_SERIAL_NUMBER_LENGTH + 1];
 
 /* Function to print buffer */
 
@@ -174,30 +294,36 @@ static void printConfiguration(configSettings_t *configSettings) {
 static bool convertToNarrow(wchar_t *src, char *dest, int bufferLength) {
   
     int i = 0;
+
+    int j = 0;
     
     if (src == NULL) return false;
 
-    while (src[i] != '\0' && i < bufferLength - 1) {
+    while (src[i] != '\0' && j < bufferLength - 1) {
       
         wchar_t code = src[i];
         
         if (code < 128) {
             
-            dest[i] = (char)code;
+            dest[j] = (char)code;
             
         } else {
             
-            dest[i] = '?';
+            dest[j] = '?';
             
-            if (code >= 0xD800 && code <= 0xD8FF) i = i + 1;
+            /* Skip the low half of a UTF-16 surrogate pair */
+
+            if (code >= 0xD800 && code <= 0xDBFF && src[i + 1] != '\0') i = i + 1;
             
         }
         
         i = i + 1;
+
+        j = j + 1;
         
     }
 
-    if (bufferLength > 0) dest[i] = '\0';
+    if (bufferLength > 0) dest[j] = '\0';
 
     return true;
 
@@ -285,15 +411,123 @@ static bool parseNumberAgainstList(char *text, int *validNumbers, int length, in
 
 }
 
-/* Function to send command to USB device */
+/* Function to enumerate devices reading only the serial number */
 
-static bool communicate(operationType_t operationType, char *path) {
+static struct hid_device_info* enumerateDevices(void) {
 
-    /* Open device */
+#ifdef HIDAPI_LIBUSB
 
-    hid_device *device = hid_open_path(path);
+    return hid_enumerate_fields(AUDIOMOTH_USB_VID, AUDIOMOTH_USB_PID, HID_INFO_SERIAL_NUMBER);
 
-    if (device == NULL) return false;
+#else
+
+    return hid_enumerate(AUDIOMOTH_USB_VID, AUDIOMOTH_USB_PID);
+
+#endif
+
+}
+
+/* Function to read a monotonic clock in milliseconds for the timing option */
+
+static double getTimeInMilliseconds() {
+
+#ifdef _WIN32
+
+    LARGE_INTEGER frequency, counter;
+
+    QueryPerformanceFrequency(&frequency);
+
+    QueryPerformanceCounter(&counter);
+
+    return 1000.0 * (double)counter.QuadPart / (double)frequency.QuadPart;
+
+#else
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return 1000.0 * (double)now.tv_sec + (double)now.tv_nsec / 1000000.0;
+
+#endif
+
+}
+
+/* Function to open device for a single request and response */
+
+static hid_device* openDevice(char *path) {
+
+#ifdef HIDAPI_LIBUSB
+
+    /* Read the response synchronously rather than starting the background read machinery, and keep the interface claimed between opens of the same device */
+
+    return hid_open_path_flags(path, HID_OPEN_NO_READ_THREAD | HID_OPEN_KEEP_CLAIMED);
+
+#else
+
+    return hid_open_path(path);
+
+#endif
+
+}
+
+/* Function to keep the reason for a communication failure before the device is closed */
+
+static void saveCommunicationError(task_t *task, hid_device *device) {
+
+    task->communicationError[0] = '\0';
+
+    const wchar_t *error = hid_error(device);
+
+    if (error == NULL) return;
+
+    char errorString[ERROR_BUFFER_SIZE];
+
+    convertToNarrow((wchar_t*)error, errorString, ERROR_BUFFER_SIZE);
+
+#ifdef HIDAPI_LIBUSB
+
+    /* Timeouts suggest a slow hub worth retrying while a missing device should be skipped */
+
+    struct hid_error_stats stats;
+
+    if (hid_get_error_stats(device, &stats) == 0) {
+
+        snprintf(task->communicationError, sizeof(task->communicationError), "%s, %lu timeouts, %lu stalls, %lu disconnects", errorString, stats.timeouts, stats.stalls, stats.no_device);
+
+        return;
+
+    }
+
+#endif
+
+    snprintf(task->communicationError, sizeof(task->communicationError), "%s", errorString);
+
+}
+
+/* Function to print a communication failure */
+
+static void printCommunicationError(task_t *task) {
+
+    if (task->communicationError[0] == '\0') {
+
+        printf("[ERROR] Problem communicating with device ID %s.\n", task->deviceID);
+
+    } else {
+
+        printf("[ERROR] Problem communicating with device ID %s (%s).\n", task->deviceID, task->communicationError);
+
+    }
+
+}
+
+/* Function to fill in the output buffer of a task with one command */
+
+static void prepareRequest(task_t *task, step_t *step, uint8_t *usbInputBuffer) {
+
+    operationType_t operationType = step->operationType;
+
+    uint8_t *usbOutputBuffer = task->usbOutputBuffer;
 
     /* Initialise receiver and transmit buffers */
  
@@ -305,19 +539,19 @@ static bool communicate(operationType_t operationType, char *path) {
 
         usbOutputBuffer[1] = HID_CONFIGURATION_MESSAGE;
 
-        memcpy(usbOutputBuffer + 2, &defaultConfigSettings, sizeof(configSettings_t));
+        memcpy(usbOutputBuffer + 2, &step->configSettings, sizeof(configSettings_t));
 
     } else if (operationType == UPDATE_GAIN_OP) {
 
         usbOutputBuffer[1] = HID_UPDATE_GAIN_MESSAGE;
 
-        memcpy(usbOutputBuffer + 2, &defaultConfigSettings, sizeof(configSettings_t));
+        memcpy(usbOutputBuffer + 2, &step->configSettings, sizeof(configSettings_t));
 
     } else if (operationType == SET_LED_OP) {
 
         usbOutputBuffer[1] = HID_SET_LED_MESSAGE;
 
-        memcpy(usbOutputBuffer + 2, &defaultConfigSettings, sizeof(configSettings_t));
+        memcpy(usbOutputBuffer + 2, &step->configSettings, sizeof(configSettings_t));
 
     } else if (operationType == RESTORE_OP) {
 
@@ -341,23 +575,29 @@ static bool communicate(operationType_t operationType, char *path) {
 
     }
 
-    /* Write buffer to device */
+    if (DEBUG) printBuffer(usbOutputBuffer);
 
-    hid_write(device, usbOutputBuffer, USB_PACKETSIZE);
+}
 
-    if (DEBUG) printBuffer(usbOutputBuffer);
+/* Function to check the response to the command in the output buffer of a task */
 
-    /* Read response from device */
+static bool checkResponse(task_t *task, hid_device *device, step_t *step, uint8_t *usbInputBuffer, int length) {
 
-    int length = hid_read_timeout(device, usbInputBuffer, USB_PACKETSIZE, 100);
+    operationType_t operationType = step->operationType;
 
-    if (DEBUG) printBuffer(usbInputBuffer);
+    uint8_t *usbOutputBuffer = task->usbOutputBuffer;
 
-    hid_close(device);
+    if (DEBUG) printBuffer(usbInputBuffer);
 
     /* Check response length and contents */
 
-    if (length != USB_PACKETSIZE) return false;
+    if (length != USB_PACKETSIZE) {
+
+        saveCommunicationError(task, device);
+
+        return false;
+
+    }
 
     bool hasNoConfiguration = operationType == RESTORE_OP || operationType == READ_OP || operationType == PERSIST_OP || operationType == FIRMWARE_OP || operationType == BOOTLOADER_OP;
 
@@ -372,633 +612,1834 @@ static bool communicate(operationType_t operationType, char *path) {
     return true;
 
 }
-               
-/* Main function */
 
-int main(int argc, char **argv) {
+/* Function to send one command to an open USB device */
 
-    /* Display version number */
+static bool sendCommand(task_t *task, hid_device *device, step_t *step, uint8_t *usbInputBuffer) {
 
-    puts("AudioMoth-USB-Microphone 1.0.1");
+    uint8_t *usbOutputBuffer = task->usbOutputBuffer;
 
-    /* Parse variables */
+    prepareRequest(task, step, usbInputBuffer);
 
-    bool parseError = false;
+#ifdef HIDAPI_LIBUSB
 
-    int numberOfSerialNumbers = 0;
+    /* Write buffer to device and read response under a single deadline */
 
-    operationType_t operationType = NO_OP;
+    int length = hid_transact(device, usbOutputBuffer, USB_PACKETSIZE, usbInputBuffer, USB_PACKETSIZE, USB_TRANSACTION_TIMEOUT);
 
-    /* Settings variable */
+#else
 
-    filterType_t filterType = NO_FILTER;
+    /* Write buffer to device */
 
-    int gain, index, lowerFilterFreq, higherFilterFreq;
+    hid_write(device, usbOutputBuffer, USB_PACKETSIZE);
 
-    /* Exit if no arguments */
+    /* Read response from device */
 
-    if (argc == 1) return OKAY_RESPONSE;
+    int length = hid_read_timeout(device, usbInputBuffer, USB_PACKETSIZE, USB_READ_TIMEOUT);
 
-    /* Parse first argument */
+#endif
 
-    int argumentCounter = 1;
+    return checkResponse(task, device, step, usbInputBuffer, length);
 
-    char *argument = argv[argumentCounter];
+}
 
-    if (parseArgument("LIST", argument)) {
+/* Function to send a session of commands to a USB device over one open handle, stopping at the first failure */
 
-        operationType = LIST_OP;
+static bool communicate(task_t *task, step_t *steps, int numberOfSteps) {
 
-    } else if (parseArgument("RESTORE", argument)) {
+    /* Open device */
 
-        operationType = RESTORE_OP;
+    task->communicationError[0] = '\0';
 
-    } else if (parseArgument("CONFIG", argument)) {
+    task->numberOfCompletedSteps = 0;
 
-        operationType = CONFIG_OP;
+    double startTime = getTimeInMilliseconds();
 
-    } else if (parseArgument("LED", argument)) {
+    hid_device *device = openDevice(task->path);
 
-        operationType = SET_LED_OP;
+    task->openTime = getTimeInMilliseconds() - startTime;
 
-        argumentCounter += 1;
+    if (device == NULL) return false;
 
-        if (argumentCounter == argc) {
+    /* Send each command in turn */
 
-            parseError = true;
+    while (task->numberOfCompletedSteps < numberOfSteps) {
 
-        } else {
+        int step = task->numberOfCompletedSteps;
 
-            argument = argv[argumentCounter];
+        startTime = getTimeInMilliseconds();
 
-            if (parseArgument("TRUE", argument) || parseArgument("ON", argument) || parseArgument("1", argument)) {
+        bool success = sendCommand(task, device, steps + step, task->usbInputBuffers[step]);
 
-                defaultConfigSettings.disableLED = false;
+        task->stepTimes[step] = getTimeInMilliseconds() - startTime;
 
-            } else if (parseArgument("FALSE", argument) || parseArgument("OFF", argument) || parseArgument("0", argument)) {
+        if (success == false) break;
 
-                defaultConfigSettings.disableLED = true;
+        task->numberOfCompletedSteps += 1;
 
-            } else {
+    }
 
-                parseError = true;
+    hid_close(device);
 
-            }
+    return task->numberOfCompletedSteps == numberOfSteps;
 
-        }
+}
+               
+/* Function to read the serial number of a device, opening the device if enumeration did not provide it */
 
-    } else if (parseArgument("UPDATE", argument)) {
+static bool readSerialNumber(struct hid_device_info *deviceInfo, char *serialNumber) {
 
-        operationType = UPDATE_GAIN_OP;
+    bool success = convertToNarrow(deviceInfo->serial_number, serialNumber, SERIAL_NUMBER_BUFFER_SIZE);
 
-    } else if (parseArgument("READ", argument)) {
+    if (success == false) {
 
-        operationType = READ_OP;
-    
-    } else if (parseArgument("PERSIST", argument)) {
+        wchar_t wideSerialNumber[SERIAL_NUMBER_BUFFER_SIZE];
 
-        operationType = PERSIST_OP;
+        hid_device *device = openDevice(deviceInfo->path);
 
-    } else if (parseArgument("FIRMWARE", argument)) {
+        if (device != NULL) {
 
-        operationType = FIRMWARE_OP;
+            int error = hid_get_serial_number_string(device, wideSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
 
-    } else if (parseArgument("BOOTLOADER", argument)) {
+            if (error == false) {
 
-        operationType = BOOTLOADER_OP;
+                success = convertToNarrow(wideSerialNumber, serialNumber, SERIAL_NUMBER_BUFFER_SIZE);
 
-    } else {
+            }
 
-        parseError = true;
+            hid_close(device);
 
-    }    
+        }
 
-    /* Parsing additional arguments */
+    }
 
-    argumentCounter += 1;
+    return success;
 
-    while (argumentCounter < argc && parseError == false) {
+}
 
-        argument = argv[argumentCounter];
+/* Function to find the device ID in a serial number, returning NULL if the serial number is not from an AudioMoth USB Microphone */
 
-        if (parseSerialNumber(argument, parsedSerialNumbers[numberOfSerialNumbers]) && operationType != LIST_OP) {
+static char* findDeviceID(char *serialNumber) {
 
-            numberOfSerialNumbers += 1;
+    char *underscore = strstr(serialNumber, "_");
 
-        } else if (parseNumberAgainstList(argument, validSampleRates, NUMBER_OF_SAMPLE_RATES, &index) && operationType == CONFIG_OP) {
+    if (underscore == NULL) return NULL;
 
-            defaultConfigSettings.sampleRate = sampleRates[index];
+    char *deviceID = underscore + 1;
 
-            defaultConfigSettings.sampleRateDivider = sampleRateDividers[index];
-        
-        } else if ((parseArgument("GAIN", argument) || parseArgument("G", argument)) && (operationType == CONFIG_OP || operationType == UPDATE_GAIN_OP)) {
+    if (deviceID != serialNumber + USB_SERIAL_NUMBER_OFFSET || strlen(deviceID) != USB_SERIAL_NUMBER_LENGTH) return NULL;
 
-            argumentCounter += 1;
+    return deviceID;
 
-            if (argumentCounter == argc) {
+}
 
-                parseError = true;
+/* Device ID hash table functions. The table uses open addressing with linear probing and is sized to stay at most half full */
 
-                break;
+static bool initialiseDeviceTable(deviceTable_t *table, int numberOfDeviceIDs) {
 
-            }
+    uint32_t size = 16;
 
-            argument = argv[argumentCounter];
+    while (size < 2 * (uint32_t)numberOfDeviceIDs) size *= 2;
 
-            bool valid = parseNumber(argument, &gain);
+    table->entries = (deviceEntry_t*)calloc(size, sizeof(deviceEntry_t));
 
-            if (valid) valid = gain >= 0 && gain <= 4;
+    table->mask = size - 1;
 
-            if (valid) {
+    return table->entries != NULL;
 
-                defaultConfigSettings.gain = gain;
+}
 
-            } else {
+static deviceEntry_t* findDeviceEntry(deviceTable_t *table, char *deviceID) {
 
-                parseError = true;
+    /* FNV-1a hash of the device ID */
 
-            }
+    uint32_t hash = 2166136261u;
 
-        } else if ((parseArgument("LOWPASSFILTER", argument) || parseArgument("LPF", argument)) && operationType == CONFIG_OP && filterType == NO_FILTER) {
+    for (int i = 0; i < USB_SERIAL_NUMBER_LENGTH; i += 1) {
 
-            filterType = LOW_PASS_FILTER;
+        hash ^= (uint8_t)deviceID[i];
 
-            argumentCounter += 1;
+        hash *= 16777619u;
 
-            if (argumentCounter == argc) {
+    }
 
-                parseError = true;
+    /* Return the entry holding the device ID or the empty entry where it belongs */
 
-                break;
+    uint32_t index = hash & table->mask;
 
-            }
+    while (table->entries[index].used && strncmp(table->entries[index].deviceID, deviceID, USB_SERIAL_NUMBER_LENGTH) != 0) index = (index + 1) & table->mask;
 
-            argument = argv[argumentCounter];
+    return table->entries + index;
 
-            bool valid = parseNumber(argument, &higherFilterFreq);
+}
 
-            if (valid) valid = higherFilterFreq <= MAXIMUM_FILTER_FREQUENCY && higherFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+static bool addDeviceID(deviceTable_t *table, char *deviceID, char *path) {
 
-            if (valid) {
+    deviceEntry_t *entry = findDeviceEntry(table, deviceID);
 
-                defaultConfigSettings.lowerFilterFreq = UINT16_MAX;
-                defaultConfigSettings.higherFilterFreq = higherFilterFreq / FILTER_FREQ_MULTIPLIER;
+    if (entry->used) return false;
 
-            } else {
+    strncpy(entry->deviceID, deviceID, USB_SERIAL_NUMBER_LENGTH);
 
-                parseError = true;
+    entry->deviceID[USB_SERIAL_NUMBER_LENGTH] = '\0';
 
-            }
+    entry->path = path;
 
-        } else if ((parseArgument("HIGHPASSFILTER", argument) || parseArgument("HPF", argument)) && operationType == CONFIG_OP && filterType == NO_FILTER) {
+    entry->used = true;
 
-            filterType = HIGH_PASS_FILTER;
+    return true;
 
-            argumentCounter += 1;
+}
 
-            if (argumentCounter == argc) {
+/* Function to compare tasks by device ID */
 
-                parseError = true;
+static int compareTasks(const void *a, const void *b) {
 
-                break;
+    return strcmp(((task_t*)a)->deviceID, ((task_t*)b)->deviceID);
 
-            }
+}
 
-            argument = argv[argumentCounter];
+#ifdef HIDAPI_LIBUSB
 
-            bool valid = parseNumber(argument, &lowerFilterFreq);
+/* Function called on the libusb event thread when an asynchronous write completes */
 
-            if (valid) valid = lowerFilterFreq <= MAXIMUM_FILTER_FREQUENCY && lowerFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+static void HID_API_CALL writeCompleted(hid_device *device, int result, void *userData) {
 
-            if (valid) {
+    task_t *task = (task_t*)userData;
 
-                defaultConfigSettings.lowerFilterFreq = lowerFilterFreq / FILTER_FREQ_MULTIPLIER;
-                defaultConfigSettings.higherFilterFreq = UINT16_MAX;
+    writeGroup_t *writeGroup = task->writeGroup;
 
-            } else {
+    double writeTime = getTimeInMilliseconds();
 
-                parseError = true;
+    pthread_mutex_lock(&writeGroup->mutex);
 
-            }
+    task->writeResult = result;
 
-        } else if ((parseArgument("BANDPASSFILTER", argument) || parseArgument("BPF", argument)) && operationType == CONFIG_OP && filterType == NO_FILTER) {
+    task->writeTime = writeTime;
 
-            filterType = BAND_PASS_FILTER;
+    writeGroup->numberOfPendingWrites -= 1;
 
-            argumentCounter += 1;
+    if (writeGroup->numberOfPendingWrites == 0) pthread_cond_signal(&writeGroup->condition);
 
-            if (argumentCounter == argc) {
+    pthread_mutex_unlock(&writeGroup->mutex);
 
-                parseError = true;
+}
 
-                break;
+/* Function to drop a task from a broadcast session after a failure */
 
-            }
+static void closeTaskDevice(task_t *task, bool saveError) {
 
-            argument = argv[argumentCounter];
+    if (saveError) saveCommunicationError(task, task->device);
 
-            bool valid = parseNumber(argument, &lowerFilterFreq);
+    hid_close(task->device);
 
-            if (valid) valid = lowerFilterFreq <= MAXIMUM_FILTER_FREQUENCY && lowerFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+    task->device = NULL;
 
-            if (valid == false) {
+}
 
-                parseError = true;
+/* Function to send a session to every task of a worker from one thread. Each command is written to all the devices before any response is read, so the writes are outstanding on the bus together rather than costing a round trip per device */
 
-            }
-                
-            argumentCounter += 1;
+static void broadcastSession(worker_t *worker) {
 
-            if (argumentCounter == argc) {
+    writeGroup_t writeGroup;
 
-                parseError = true;
+    pthread_mutex_init(&writeGroup.mutex, NULL);
 
-                break;
+    pthread_cond_init(&writeGroup.condition, NULL);
 
-            }
+    writeGroup.numberOfPendingWrites = 0;
 
-            argument = argv[argumentCounter];
+    /* Open each device */
 
-            valid = parseNumber(argument, &higherFilterFreq);
+    for (int i = worker->firstTask; i < worker->numberOfTasks; i += worker->numberOfWorkers) {
 
-            if (valid) valid = higherFilterFreq <= MAXIMUM_FILTER_FREQUENCY && higherFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+        task_t *task = worker->tasks + i;
 
-            if (valid) {
+        task->communicationError[0] = '\0';
 
-                defaultConfigSettings.lowerFilterFreq = lowerFilterFreq / FILTER_FREQ_MULTIPLIER;
-                defaultConfigSettings.higherFilterFreq = higherFilterFreq / FILTER_FREQ_MULTIPLIER;
-                
-            } else {
+        task->numberOfCompletedSteps = 0;
 
-                parseError = true;
+        task->writeGroup = &writeGroup;
 
-            }
+        double startTime = getTimeInMilliseconds();
+
+        task->device = task->path == NULL ? NULL : openDevice(task->path);
+
+        task->openTime = getTimeInMilliseconds() - startTime;
+
+    }
+
+    for (int step = 0; step < worker->numberOfSteps; step += 1) {
+
+        step_t *currentStep = worker->steps + step;
+
+        /* The whole step shares one deadline so that silent devices do not each add a full timeout */
+
+        double deadline = getTimeInMilliseconds() + USB_TRANSACTION_TIMEOUT;
+
+        /* Discard any late reply to an earlier command before writing so that it is not read as the response */
+
+        for (int i = worker->firstTask; i < worker->numberOfTasks; i += worker->numberOfWorkers) {
+
+            task_t *task = worker->tasks + i;
+
+            if (task->device != NULL) hid_discard_input(task->device);
+
+        }
+
+        /* Write the command to every device still in the session. The count is raised before submitting as the write can complete straight away */
+
+        for (int i = worker->firstTask; i < worker->numberOfTasks; i += worker->numberOfWorkers) {
+
+            task_t *task = worker->tasks + i;
+
+            if (task->device == NULL) continue;
+
+            prepareRequest(task, currentStep, task->usbInputBuffers[step]);
+
+            task->writeResult = -1;
+
+            pthread_mutex_lock(&writeGroup.mutex);
+
+            writeGroup.numberOfPendingWrites += 1;
+
+            pthread_mutex_unlock(&writeGroup.mutex);
+
+            int result = hid_write_async(task->device, task->usbOutputBuffer, USB_PACKETSIZE, writeCompleted, task);
+
+            if (result != 0) {
+
+                pthread_mutex_lock(&writeGroup.mutex);
+
+                writeGroup.numberOfPendingWrites -= 1;
+
+                pthread_mutex_unlock(&writeGroup.mutex);
+
+                closeTaskDevice(task, true);
+
+            }
+
+        }
+
+        /* Wait for all the writes to complete */
+
+        pthread_mutex_lock(&writeGroup.mutex);
+
+        while (writeGroup.numberOfPendingWrites > 0) pthread_cond_wait(&writeGroup.condition, &writeGroup.mutex);
+
+        pthread_mutex_unlock(&writeGroup.mutex);
+
+        /* Read and check each response */
+
+        for (int i = worker->firstTask; i < worker->numberOfTasks; i += worker->numberOfWorkers) {
+
+            task_t *task = worker->tasks + i;
+
+            if (task->device == NULL) continue;
+
+            if (task->writeResult < 0) {
+
+                closeTaskDevice(task, true);
+
+                continue;
+
+            }
+
+            int timeout = (int)(deadline - getTimeInMilliseconds());
+
+            int length = hid_read_timeout(task->device, task->usbInputBuffers[step], USB_PACKETSIZE, timeout > 0 ? timeout : 0);
+
+            bool success = checkResponse(task, task->device, currentStep, task->usbInputBuffers[step], length);
+
+            task->stepTimes[step] = getTimeInMilliseconds() - task->writeTime;
+
+            if (success == false) {
+
+                closeTaskDevice(task, false);
+
+                continue;
+
+            }
+
+            task->numberOfCompletedSteps += 1;
+
+        }
+
+    }
+
+    /* Close the devices which completed the session */
+
+    for (int i = worker->firstTask; i < worker->numberOfTasks; i += worker->numberOfWorkers) {
+
+        task_t *task = worker->tasks + i;
+
+        if (task->device != NULL) closeTaskDevice(task, false);
+
+    }
+
+    pthread_cond_destroy(&writeGroup.condition);
+
+    pthread_mutex_destroy(&writeGroup.mutex);
+
+}
+
+#endif
+
+/* Worker functions. Each worker takes every Nth task so no locking is needed between workers */
+
+static void runWorker(worker_t *worker) {
+
+#ifdef HIDAPI_LIBUSB
+
+    /* Overlap the writes to the devices of this worker rather than sending to one device at a time */
+
+    if (worker->numberOfTasks > worker->firstTask + worker->numberOfWorkers) {
+
+        broadcastSession(worker);
+
+        return;
+
+    }
+
+#endif
+
+    for (int i = worker->firstTask; i < worker->numberOfTasks; i += worker->numberOfWorkers) {
+
+        task_t *task = worker->tasks + i;
+
+        if (task->path != NULL) communicate(task, worker->steps, worker->numberOfSteps);
+
+    }
+
+}
+
+#ifdef _WIN32
+
+static DWORD WINAPI workerThread(LPVOID parameter) {
+
+    runWorker((worker_t*)parameter);
+
+    return 0;
+
+}
+
+static bool startWorker(worker_t *worker) {
+
+    worker->thread = CreateThread(NULL, 0, workerThread, worker, 0, NULL);
+
+    return worker->thread != NULL;
+
+}
+
+static void joinWorker(worker_t *worker) {
+
+    WaitForSingleObject(worker->thread, INFINITE);
+
+    CloseHandle(worker->thread);
+
+}
+
+#else
+
+static void* workerThread(void *parameter) {
+
+    runWorker((worker_t*)parameter);
+
+    return NULL;
+
+}
+
+static bool startWorker(worker_t *worker) {
+
+    return pthread_create(&worker->thread, NULL, workerThread, worker) == 0;
+
+}
+
+static void joinWorker(worker_t *worker) {
+
+    pthread_join(worker->thread, NULL);
+
+}
+
+#endif
+
+/* Function to send the command to every task using up to the given number of workers */
+
+static void runTasks(task_t *tasks, int numberOfTasks, int numberOfWorkers, step_t *steps, int numberOfSteps) {
+
+    worker_t workers[MAXIMUM_NUMBER_OF_WORKERS];
+
+    bool started[MAXIMUM_NUMBER_OF_WORKERS];
+
+    if (numberOfWorkers > numberOfTasks) numberOfWorkers = numberOfTasks;
+
+    for (int i = 0; i < numberOfWorkers; i += 1) {
+
+        workers[i].tasks = tasks;
+
+        workers[i].firstTask = i;
+
+        workers[i].numberOfTasks = numberOfTasks;
+
+        workers[i].numberOfWorkers = numberOfWorkers;
+
+        workers[i].steps = steps;
+
+        workers[i].numberOfSteps = numberOfSteps;
+
+    }
+
+    /* The first worker runs on this thread, as does any worker whose thread cannot be started */
+
+    for (int i = 1; i < numberOfWorkers; i += 1) started[i] = startWorker(workers + i);
+
+    if (numberOfWorkers > 0) runWorker(workers);
+
+    for (int i = 1; i < numberOfWorkers; i += 1) {
+
+        if (started[i]) {
+
+            joinWorker(workers + i);
+
+        } else {
+
+            runWorker(workers + i);
+
+        }
+
+    }
+
+}
+
+/* Function to print the result of one command */
+
+static void printStepResult(char *deviceID, operationType_t operationType, uint8_t *usbInputBuffer) {
+
+    if (operationType == READ_OP) {
+
+        printf("%s - ", deviceID);
+
+        printConfiguration((configSettings_t*)(usbInputBuffer + 1));
+
+    } else if (operationType == FIRMWARE_OP) {
+
+        printf("%s - ", deviceID);
+
+        printf("%s (%d.%d.%d)\n", usbInputBuffer + 4, *((uint8_t*)usbInputBuffer + 1), *((uint8_t*)usbInputBuffer + 2), *((uint8_t*)usbInputBuffer + 3));
+
+    } else {
+
+        char *operationString = operationStrings[operationType - 2];
+
+        printf("Sent %s command to device ID %s.\n", operationString, deviceID);
+
+    }
+
+}
+
+/* Function to print how long a task took to open the device and to complete each command */
+
+static void printTaskTiming(task_t *task, step_t *steps) {
+
+    printf("Opened device ID %s in %.3f ms.\n", task->deviceID, task->openTime);
+
+    for (int i = 0; i < task->numberOfCompletedSteps; i += 1) {
+
+        char *operationString = operationStrings[steps[i].operationType - 2];
+
+        printf("Completed %s command to device ID %s in %.3f ms.\n", operationString, task->deviceID, task->stepTimes[i]);
+
+    }
+
+}
+
+/* Function to print the result of each command of a task */
+
+static void printTaskResult(task_t *task, step_t *steps, int numberOfSteps, bool timing) {
+
+    if (task->path == NULL) {
+
+        printf("[ERROR] Could not find device ID %s.\n", task->deviceID);
+
+        return;
+
+    }
+
+    for (int i = 0; i < task->numberOfCompletedSteps; i += 1) printStepResult(task->deviceID, steps[i].operationType, task->usbInputBuffers[i]);
+
+    if (timing) printTaskTiming(task, steps);
+
+    if (task->numberOfCompletedSteps < numberOfSteps) printCommunicationError(task);
+
+}
+
+/* Function to parse one operation and its settings, stopping at THEN or the end of the arguments */
+
+static bool parseStep(int argc, char **argv, int *argumentCounterPtr, step_t *step, int *numberOfSerialNumbers) {
+
+    bool parseError = false;
+
+    int argumentCounter = *argumentCounterPtr;
+
+    operationType_t operationType = NO_OP;
+
+    /* Settings variable */
+
+    configSettings_t *configSettings = &step->configSettings;
+
+    filterType_t filterType = NO_FILTER;
+
+    int gain, index, lowerFilterFreq, higherFilterFreq;
+
+    if (argumentCounter == argc) return false;
+
+    /* Parse operation */
+
+    char *argument = argv[argumentCounter];
+
+    if (parseArgument("LIST", argument)) {
+
+        operationType = LIST_OP;
+
+    } else if (parseArgument("RESTORE", argument)) {
+
+        operationType = RESTORE_OP;
+
+    } else if (parseArgument("CONFIG", argument)) {
+
+        operationType = CONFIG_OP;
+
+    } else if (parseArgument("LED", argument)) {
+
+        operationType = SET_LED_OP;
+
+        argumentCounter += 1;
+
+        if (argumentCounter == argc) {
+
+            parseError = true;
+
+        } else {
+
+            argument = argv[argumentCounter];
+
+            if (parseArgument("TRUE", argument) || parseArgument("ON", argument) || parseArgument("1", argument)) {
+
+                configSettings->disableLED = false;
+
+            } else if (parseArgument("FALSE", argument) || parseArgument("OFF", argument) || parseArgument("0", argument)) {
+
+                configSettings->disableLED = true;
+
+            } else {
+
+                parseError = true;
+
+            }
+
+        }
+
+    } else if (parseArgument("UPDATE", argument)) {
+
+        operationType = UPDATE_GAIN_OP;
+
+    } else if (parseArgument("READ", argument)) {
+
+        operationType = READ_OP;
+    
+    } else if (parseArgument("PERSIST", argument)) {
+
+        operationType = PERSIST_OP;
+
+    } else if (parseArgument("FIRMWARE", argument)) {
+
+        operationType = FIRMWARE_OP;
+
+    } else if (parseArgument("BOOTLOADER", argument)) {
+
+        operationType = BOOTLOADER_OP;
+
+    } else {
+
+        parseError = true;
+
+    }    
+
+    /* Parsing additional arguments */
+
+    argumentCounter += 1;
+
+    while (argumentCounter < argc && parseError == false && parseArgument("THEN", argv[argumentCounter]) == false) {
+
+        argument = argv[argumentCounter];
+
+        if (*numberOfSerialNumbers < MAXIMUM_NUMBER_OF_DEVICES && parseSerialNumber(argument, parsedSerialNumbers[*numberOfSerialNumbers]) && operationType != LIST_OP) {
+
+            *numberOfSerialNumbers += 1;
+
+        } else if (parseNumberAgainstList(argument, validSampleRates, NUMBER_OF_SAMPLE_RATES, &index) && operationType == CONFIG_OP) {
+
+            configSettings->sampleRate = sampleRates[index];
+
+            configSettings->sampleRateDivider = sampleRateDividers[index];
+        
+        } else if ((parseArgument("GAIN", argument) || parseArgument("G", argument)) && (operationType == CONFIG_OP || operationType == UPDATE_GAIN_OP)) {
+
+            argumentCounter += 1;
+
+            if (argumentCounter == argc) {
+
+                parseError = true;
+
+                break;
+
+            }
+
+            argument = argv[argumentCounter];
+
+            bool valid = parseNumber(argument, &gain);
+
+            if (valid) valid = gain >= 0 && gain <= 4;
+
+            if (valid) {
+
+                configSettings->gain = gain;
+
+            } else {
+
+                parseError = true;
+
+            }
+
+        } else if ((parseArgument("LOWPASSFILTER", argument) || parseArgument("LPF", argument)) && operationType == CONFIG_OP && filterType == NO_FILTER) {
+
+            filterType = LOW_PASS_FILTER;
+
+            argumentCounter += 1;
+
+            if (argumentCounter == argc) {
+
+                parseError = true;
+
+                break;
+
+            }
+
+            argument = argv[argumentCounter];
+
+            bool valid = parseNumber(argument, &higherFilterFreq);
+
+            if (valid) valid = higherFilterFreq <= MAXIMUM_FILTER_FREQUENCY && higherFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+
+            if (valid) {
+
+                configSettings->lowerFilterFreq = UINT16_MAX;
+                configSettings->higherFilterFreq = higherFilterFreq / FILTER_FREQ_MULTIPLIER;
+
+            } else {
+
+                parseError = true;
+
+            }
+
+        } else if ((parseArgument("HIGHPASSFILTER", argument) || parseArgument("HPF", argument)) && operationType == CONFIG_OP && filterType == NO_FILTER) {
+
+            filterType = HIGH_PASS_FILTER;
+
+            argumentCounter += 1;
+
+            if (argumentCounter == argc) {
+
+                parseError = true;
+
+                break;
+
+            }
+
+            argument = argv[argumentCounter];
+
+            bool valid = parseNumber(argument, &lowerFilterFreq);
+
+            if (valid) valid = lowerFilterFreq <= MAXIMUM_FILTER_FREQUENCY && lowerFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+
+            if (valid) {
+
+                configSettings->lowerFilterFreq = lowerFilterFreq / FILTER_FREQ_MULTIPLIER;
+                configSettings->higherFilterFreq = UINT16_MAX;
+
+            } else {
+
+                parseError = true;
+
+            }
+
+        } else if ((parseArgument("BANDPASSFILTER", argument) || parseArgument("BPF", argument)) && operationType == CONFIG_OP && filterType == NO_FILTER) {
+
+            filterType = BAND_PASS_FILTER;
+
+            argumentCounter += 1;
+
+            if (argumentCounter == argc) {
+
+                parseError = true;
+
+                break;
+
+            }
+
+            argument = argv[argumentCounter];
+
+            bool valid = parseNumber(argument, &lowerFilterFreq);
+
+            if (valid) valid = lowerFilterFreq <= MAXIMUM_FILTER_FREQUENCY && lowerFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+
+            if (valid == false) {
+
+                parseError = true;
+
+            }
+                
+            argumentCounter += 1;
+
+            if (argumentCounter == argc) {
+
+                parseError = true;
+
+                break;
+
+            }
+
+            argument = argv[argumentCounter];
+
+            valid = parseNumber(argument, &higherFilterFreq);
+
+            if (valid) valid = higherFilterFreq <= MAXIMUM_FILTER_FREQUENCY && higherFilterFreq % FILTER_FREQ_MULTIPLIER == 0;
+
+            if (valid) {
+
+                configSettings->lowerFilterFreq = lowerFilterFreq / FILTER_FREQ_MULTIPLIER;
+                configSettings->higherFilterFreq = higherFilterFreq / FILTER_FREQ_MULTIPLIER;
+                
+            } else {
+
+                parseError = true;
+
+            }
 
         } else if ((parseArgument("LOWGAINRANGE", argument) || parseArgument("LGR", argument)) && (operationType == CONFIG_OP || operationType == UPDATE_GAIN_OP)) {
 
-            defaultConfigSettings.enableLowGainRange = true;
+            configSettings->enableLowGainRange = true;
+
+        } else if ((parseArgument("ENERGYSAVERMODE", argument) || parseArgument("ESM", argument)) && operationType == CONFIG_OP) {
+
+            configSettings->enableEnergySaverMode = true;
+
+        } else if ((parseArgument("DISABLE48HZ", argument) || parseArgument("D48", argument)) && operationType == CONFIG_OP) {
+
+            configSettings->disable48HzDCBlockingFilter = true;
+
+        } else {
+
+            parseError = true;
+
+        } 
+
+        argumentCounter += 1;
+
+    }
+
+    step->operationType = operationType;
+
+    step->filterType = filterType;
+
+    *argumentCounterPtr = argumentCounter;
+
+    return parseError == false;
+
+}
+
+/* Function to check the filter settings of an operation, returning an error message if they are not valid */
+
+static char* checkFilterSettings(step_t *step) {
+
+    configSettings_t *configSettings = &step->configSettings;
+
+    filterType_t filterType = step->filterType;
+
+    if (filterType == BAND_PASS_FILTER && configSettings->lowerFilterFreq >= configSettings->higherFilterFreq) {
+
+        return "[ERROR] Band-pass lower frequency is not less than higher frequency.";
+
+    }
+
+    int nyquistFrequency = configSettings->sampleRate / configSettings->sampleRateDivider / FILTER_FREQ_MULTIPLIER / 2;
+
+    if (filterType == LOW_PASS_FILTER && configSettings->higherFilterFreq > nyquistFrequency) {
+
+        return "[ERROR] Low-pass frequency is not compatible with sample rate.";
+
+    } else if (filterType == HIGH_PASS_FILTER && configSettings->lowerFilterFreq > nyquistFrequency) {
+
+        return "[ERROR] High-pass frequency is not compatible with sample rate.";
+
+    } else if (filterType == BAND_PASS_FILTER && configSettings->lowerFilterFreq > nyquistFrequency) {
+
+        return "[ERROR] Band-pass lower frequency is not compatible with sample rate.";
+
+    } else if (filterType == BAND_PASS_FILTER && configSettings->higherFilterFreq > nyquistFrequency) {
+
+        return "[ERROR] Band-pass higher frequency is not compatible with sample rate.";
+
+    }
+
+    return NULL;
+
+}
+
+/* Function to parse and run a command line, using the given enumeration if the devices have already been enumerated */
+
+static int runCommand(int argc, char **argv, bool enumerated, struct hid_device_info *devices) {
+
+    /* Parse variables */
+
+    bool parseError = false;
+
+    int numberOfSerialNumbers = 0;
+
+    int numberOfWorkers = 1;
+
+    bool timing = false;
+
+    step_t steps[MAXIMUM_NUMBER_OF_STEPS];
+
+    int numberOfSteps = 0;
+
+    /* Exit if no arguments */
+
+    if (argc == 1) return OKAY_RESPONSE;
+
+    /* Parse options */
+
+    int argumentCounter = 1;
+
+    while (argumentCounter < argc) {
+
+        if (parseArgument("-T", argv[argumentCounter]) || parseArgument("--TIMING", argv[argumentCounter])) {
+
+            timing = true;
+
+            argumentCounter += 1;
+
+            continue;
+
+        }
+
+        if (parseArgument("-J", argv[argumentCounter]) == false && parseArgument("--PARALLEL", argv[argumentCounter]) == false) break;
+
+        argumentCounter += 1;
+
+        bool valid = argumentCounter < argc && parseNumber(argv[argumentCounter], &numberOfWorkers);
+
+        if (valid) valid = numberOfWorkers >= 1 && numberOfWorkers <= MAXIMUM_NUMBER_OF_WORKERS;
+
+        if (valid == false) {
+
+            puts("[ERROR] Could not parse arguments.");
+
+            return ERROR_RESPONSE;
+
+        }
+
+        argumentCounter += 1;
+
+    }
+
+    /* Exit if no command */
+
+    if (argumentCounter == argc) return OKAY_RESPONSE;
+
+    /* Parse operations separated by THEN */
+
+    while (parseError == false) {
+
+        if (numberOfSteps == MAXIMUM_NUMBER_OF_STEPS) {
+
+            parseError = true;
+
+            break;
+
+        }
+
+        steps[numberOfSteps].configSettings = defaultConfigSettings;
+
+        parseError = parseStep(argc, argv, &argumentCounter, steps + numberOfSteps, &numberOfSerialNumbers) == false;
+
+        numberOfSteps += 1;
+
+        if (argumentCounter == argc) break;
+
+        argumentCounter += 1;
+
+    }
+
+    /* LIST cannot be combined with other operations */
+
+    for (int i = 0; i < numberOfSteps; i += 1) {
+
+        if (numberOfSteps > 1 && steps[i].operationType == LIST_OP) parseError = true;
+
+    }
+
+    operationType_t operationType = steps[0].operationType;
+
+    /* Return on error so far */
+
+    if (parseError) {
+
+        puts("[ERROR] Could not parse arguments.");
+
+        return ERROR_RESPONSE;
+
+    }
+
+    /* Check filter values */
+
+    for (int i = 0; i < numberOfSteps; i += 1) {
+
+        char *errorMessage = checkFilterSettings(steps + i);
+
+        if (errorMessage != NULL) {
+
+            puts(errorMessage);
+
+            return ERROR_RESPONSE;
+
+        }
+
+    }
+
+    /* Check for repeated serial numbers */ 
+
+    deviceTable_t requestedDeviceIDs;
+
+    if (initialiseDeviceTable(&requestedDeviceIDs, numberOfSerialNumbers) == false) {
+
+        puts("[ERROR] Could not allocate memory.");
+
+        return ERROR_RESPONSE;
+
+    }
+
+    bool repeated = false;
+
+    for (int i = 0; i < numberOfSerialNumbers; i += 1) {
+
+        if (addDeviceID(&requestedDeviceIDs, parsedSerialNumbers[i], NULL) == false) repeated = true;
+
+    }
+
+    free(requestedDeviceIDs.entries);
+
+    if (repeated) {
+
+        puts("[ERROR] Repeated device ID.");
+
+        return ERROR_RESPONSE; 
+
+    }
+
+    /* Access enumerated devices */
+    
+    struct hid_device_info *enumeratedDevices = enumerated ? devices : enumerateDevices();
+
+    struct hid_device_info *deviceInfo = enumeratedDevices;
+
+    int numberOfDevices = 0;
+
+    for (struct hid_device_info *info = deviceInfo; info != NULL; info = info->next) numberOfDevices += 1;
+
+    /* Perform the requested action */
+
+    if (operationType == LIST_OP) {
+
+        /* List enumerated AudioMoth USB Microphone */
+
+        while (deviceInfo != NULL) {
+        
+            char *path = deviceInfo->path;
+            
+            if (path != NULL) {
+
+                char serialNumber[SERIAL_NUMBER_BUFFER_SIZE];
+        
+                bool success = readSerialNumber(deviceInfo, serialNumber);
+        
+                if (success) {
+            
+                    char *deviceID = findDeviceID(serialNumber);
+        
+                    if (deviceID != NULL) {
+
+                        int j = 0;
+            
+                        bool digit = false;
+                        
+                        char frequencyString[] = {0, 0, 0, 0};
+            
+                        for (int i = 0; i < USB_SERIAL_NUMBER_OFFSET - 1; i += 1) {
+                    
+                            if (digit || serialNumber[i] > '0') {
+                        
+                                frequencyString[j++] = serialNumber[i];
+
+                                digit = true;
+
+                            }
+
+                        }
+
+                        printf("%s - %skHz AudioMoth USB Microphone\n", deviceID, frequencyString);
+                            
+                    }
+                        
+                } else {
+
+                    puts("[ERROR] Problem accessing USB device.");
+                    
+                    break;
+
+                }
+                
+            }
+            
+            deviceInfo = deviceInfo->next;
+
+        }
+
+    } else if (deviceInfo == NULL) {
+        
+        puts("[WARNING] No AudioMoth USB Microphones found.");
+
+    } else {
+
+        /* Build a task for each device which will receive the command */
+
+        int maximumNumberOfTasks = numberOfDevices > numberOfSerialNumbers ? numberOfDevices : numberOfSerialNumbers;
+
+        task_t *tasks = (task_t*)calloc(maximumNumberOfTasks, sizeof(task_t));
+
+        if (tasks == NULL) {
+
+            puts("[ERROR] Could not allocate memory.");
+
+            if (enumerated == false) hid_free_enumeration(enumeratedDevices);
+
+            return ERROR_RESPONSE;
+
+        }
+
+        int numberOfTasks = 0;
+
+        bool cancel = false;
+
+        if (numberOfSerialNumbers == 0) {
+
+            /* Send CONFIG, UPDATE, LED, RESTORE, READ, PERSIST, FIRMWARE or BOOTLOADER to all connected AudioMoth USB Microphone */
+
+            while (deviceInfo != NULL && cancel == false) {
+
+                char *path = deviceInfo->path;
+            
+                if (path != NULL) {
+
+                    char serialNumber[SERIAL_NUMBER_BUFFER_SIZE];
+        
+                    bool success = readSerialNumber(deviceInfo, serialNumber);
+            
+                    if (success) {
+                    
+                        char *deviceID = findDeviceID(serialNumber);
+
+                        if (deviceID != NULL) {
+
+                            tasks[numberOfTasks].path = path;
+
+                            strcpy(tasks[numberOfTasks].deviceID, deviceID);
+
+                            numberOfTasks += 1;
+
+                        }
+                    
+                    } else {
+
+                        cancel = true;
+
+                    }
+                
+                }
+
+                deviceInfo = deviceInfo->next;
+
+            }
+
+            /* Report in device ID order so the output does not depend on enumeration order */
+
+            qsort(tasks, numberOfTasks, sizeof(task_t), compareTasks);
+
+        } else {
+
+            /* Send CONFIG, UPDATE, LED, RESTORE, READ, PERSIST, FIRMWARE or BOOTLOADER to AudioMoth USB Microphone specified by serial number */
+
+            deviceTable_t connectedDeviceIDs;
+
+            if (initialiseDeviceTable(&connectedDeviceIDs, numberOfDevices) == false) {
+
+                puts("[ERROR] Could not allocate memory.");
+
+                free(tasks);
+
+                if (enumerated == false) hid_free_enumeration(enumeratedDevices);
+
+                return ERROR_RESPONSE;
+
+            }
+
+            /* Read the serial number of each connected device once. A device which cannot be read is reported but does not stop the others being served */
+
+            while (deviceInfo != NULL) {
+            
+                char *path = deviceInfo->path;
+            
+                if (path != NULL) {
+
+                    char serialNumber[SERIAL_NUMBER_BUFFER_SIZE];
+        
+                    bool success = readSerialNumber(deviceInfo, serialNumber);
+
+                    if (success) {
+
+                        char *deviceID = findDeviceID(serialNumber);
+
+                        if (deviceID != NULL) addDeviceID(&connectedDeviceIDs, deviceID, path);
+
+                    } else {
+
+                        cancel = true;
+
+                    }
+
+                }
+
+                deviceInfo = deviceInfo->next;
+
+            }
+
+            /* Look up each requested device ID */
+
+            for (int i = 0; i < numberOfSerialNumbers; i += 1) {
+
+                task_t *task = tasks + numberOfTasks;
+
+                strcpy(task->deviceID, parsedSerialNumbers[i]);
+
+                deviceEntry_t *entry = findDeviceEntry(&connectedDeviceIDs, parsedSerialNumbers[i]);
+
+                if (entry->used) task->path = entry->path;
+
+                numberOfTasks += 1;
+
+            }
+
+            free(connectedDeviceIDs.entries);
+
+        }
+
+        /* Send the command to the devices, in parallel if requested, and then print the results in task order */
+
+        runTasks(tasks, numberOfTasks, numberOfWorkers, steps, numberOfSteps);
+
+        for (int i = 0; i < numberOfTasks; i += 1) printTaskResult(tasks + i, steps, numberOfSteps, timing);
+
+        if (cancel) puts("[ERROR] Problem accessing USB device.");
+
+        free(tasks);
+
+    }
+
+    if (enumerated == false) hid_free_enumeration(enumeratedDevices);
+
+    return OKAY_RESPONSE;
+
+}
+
+/* Function to split a command line into arguments after the program name, returning false if there are too many */
+
+static bool splitArguments(char *line, char **arguments, int *numberOfArguments) {
+
+    *numberOfArguments = 0;
+
+    arguments[(*numberOfArguments)++] = "AudioMoth-USB-Microphone";
+
+    for (char *token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+
+        if (*numberOfArguments == MAXIMUM_NUMBER_OF_ARGUMENTS) return false;
+
+        arguments[(*numberOfArguments)++] = token;
+
+    }
+
+    return true;
+
+}
+
+/* Function to run one command per line from a file or standard input, enumerating the devices once */
+
+static int runBatch(int argc, char **argv) {
+
+    FILE *input = stdin;
+
+    if (argc > 3) {
+
+        puts("[ERROR] Could not parse arguments.");
+
+        return ERROR_RESPONSE;
+
+    }
+
+    if (argc == 3 && strcmp(argv[2], "-") != 0) {
+
+        input = fopen(argv[2], "r");
+
+        if (input == NULL) {
+
+            printf("[ERROR] Could not open batch file %s.\n", argv[2]);
+
+            return ERROR_RESPONSE;
+
+        }
+
+    }
+
+    struct hid_device_info *devices = enumerateDevices();
+
+    int response = OKAY_RESPONSE;
+
+    char line[COMMAND_LINE_SIZE];
+
+    int lineNumber = 0;
+
+    while (fgets(line, COMMAND_LINE_SIZE, input) != NULL) {
+
+        lineNumber += 1;
+
+        /* Skip the rest of a line which is too long */
+
+        bool tooLong = strchr(line, '\n') == NULL && feof(input) == 0;
+
+        if (tooLong) {
+
+            int character;
+
+            while ((character = fgetc(input)) != EOF && character != '\n') {}
+
+            printf("[ERROR] Line %d is too long.\n", lineNumber);
+
+            response = ERROR_RESPONSE;
+
+            continue;
+
+        }
+
+        /* Skip blank lines and comments */
+
+        char *arguments[MAXIMUM_NUMBER_OF_ARGUMENTS];
+
+        int numberOfArguments;
+
+        bool split = splitArguments(line, arguments, &numberOfArguments);
+
+        if (split && (numberOfArguments == 1 || arguments[1][0] == '#')) continue;
+
+        if (split == false) {
+
+            puts("[ERROR] Could not parse arguments.");
+
+            response = ERROR_RESPONSE;
+
+        } else if (runCommand(numberOfArguments, arguments, true, devices) != OKAY_RESPONSE) {
+
+            response = ERROR_RESPONSE;
+
+        }
+
+        /* Let a reader of the output see each result as it happens */
+
+        fflush(stdout);
+
+    }
+
+    if (input != stdin) fclose(input);
+
+    hid_free_enumeration(devices);
+
+    return response;
+
+}
+
+#ifdef DAEMON_SUPPORTED
+
+/* Function to find the daemon socket, in the user's runtime directory if there is one */
+
+static bool getSocketAddress(struct sockaddr_un *address) {
+
+    memset(address, 0, sizeof(struct sockaddr_un));
+
+    address->sun_family = AF_UNIX;
+
+    char *directory = getenv("XDG_RUNTIME_DIR");
+
+    int length;
+
+    if (directory != NULL && directory[0] != '\0') {
+
+        length = snprintf(address->sun_path, sizeof(address->sun_path), "%s/%s.sock", directory, DAEMON_SOCKET_NAME);
+
+    } else {
 
-        } else if ((parseArgument("ENERGYSAVERMODE", argument) || parseArgument("ESM", argument)) && operationType == CONFIG_OP) {
+        length = snprintf(address->sun_path, sizeof(address->sun_path), "/tmp/%s-%u.sock", DAEMON_SOCKET_NAME, (unsigned int)getuid());
 
-            defaultConfigSettings.enableEnergySaverMode = true;
+    }
 
-        } else if ((parseArgument("DISABLE48HZ", argument) || parseArgument("D48", argument)) && operationType == CONFIG_OP) {
+    return length > 0 && length < (int)sizeof(address->sun_path);
 
-            defaultConfigSettings.disable48HzDCBlockingFilter = true;
+}
 
-        } else {
+/* Function to check that the process at the other end of a connection belongs to this user */
 
-            parseError = true;
+static bool peerIsThisUser(int connection) {
 
-        } 
+#ifdef __linux__
 
-        argumentCounter += 1;
+    struct ucred credentials;
+
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) return false;
+
+    return credentials.uid == getuid();
+
+#else
+
+    uid_t uid;
+
+    gid_t gid;
+
+    if (getpeereid(connection, &uid, &gid) != 0) return false;
+
+    return uid == getuid();
+
+#endif
+
+}
+
+/* Function to connect to a running daemon, returning -1 if there is none or it is not run by this user */
+
+static int connectToDaemon(void) {
+
+    struct sockaddr_un address;
+
+    if (getSocketAddress(&address) == false) return -1;
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (connection < 0) return -1;
+
+    if (connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+
+        close(connection);
+
+        return -1;
 
     }
 
-    /* Return on error so far */
+    /* Another user may have created the socket first in a shared directory such as /tmp */
 
-    if (parseError) {
+    if (peerIsThisUser(connection) == false) {
 
-        puts("[ERROR] Could not parse arguments.");
+        close(connection);
 
-        return ERROR_RESPONSE;
+        return -1;
 
     }
 
-    /* Check filter values */
+    return connection;
 
-    if (filterType == BAND_PASS_FILTER && defaultConfigSettings.lowerFilterFreq >= defaultConfigSettings.higherFilterFreq) {
+}
 
-        puts("[ERROR] Band-pass lower frequency is not less than higher frequency.");
+/* Function to write a whole buffer to a socket */
 
-        return ERROR_RESPONSE; 
+static bool writeAll(int connection, char *buffer, int length) {
+
+    while (length > 0) {
+
+        ssize_t written = write(connection, buffer, length);
+
+        if (written < 0 && errno == EINTR) continue;
+
+        if (written <= 0) return false;
+
+        buffer += written;
+
+        length -= written;
 
     }
 
-    int nyquistFrequency = defaultConfigSettings.sampleRate / defaultConfigSettings.sampleRateDivider / FILTER_FREQ_MULTIPLIER / 2;
+    return true;
+
+}
 
-    if (filterType == LOW_PASS_FILTER && defaultConfigSettings.higherFilterFreq > nyquistFrequency) {
+/* Function to send the command line to a running daemon and print its output. Returns false if the command should run in this process instead */
 
-        puts("[ERROR] Low-pass frequency is not compatible with sample rate.");
+static bool forwardCommand(int argc, char **argv, int *response) {
 
-        return ERROR_RESPONSE; 
+    /* The request is the arguments on one line */
 
-    } else if (filterType == HIGH_PASS_FILTER && defaultConfigSettings.lowerFilterFreq > nyquistFrequency) {
+    char request[COMMAND_LINE_SIZE];
 
-        puts("[ERROR] High-pass frequency is not compatible with sample rate.");
+    int length = 0;
 
-        return ERROR_RESPONSE; 
+    for (int i = 1; i < argc; i += 1) {
 
-    } else if (filterType == BAND_PASS_FILTER && defaultConfigSettings.lowerFilterFreq > nyquistFrequency) {
+        if (strpbrk(argv[i], " \t\r\n") != NULL) return false;
 
-        puts("[ERROR] Band-pass lower frequency is not compatible with sample rate.");
+        length += snprintf(request + length, COMMAND_LINE_SIZE - length, i == 1 ? "%s" : " %s", argv[i]);
 
-        return ERROR_RESPONSE; 
+        if (length >= COMMAND_LINE_SIZE - 1) return false;
 
-    } else if (filterType == BAND_PASS_FILTER && defaultConfigSettings.higherFilterFreq > nyquistFrequency) {
+    }
 
-        puts("[ERROR] Band-pass higher frequency is not compatible with sample rate.");
+    request[length++] = '\n';
 
-        return ERROR_RESPONSE; 
+    int connection = connectToDaemon();
+
+    if (connection < 0) return false;
+
+    if (writeAll(connection, request, length) == false) {
+
+        close(connection);
+
+        return false;
 
     }
 
-    /* Check for repeated serial numbers */ 
+    /* The response is the command output followed by a status line */
 
-    for (int i = 0; i < numberOfSerialNumbers; i += 1) {
+    FILE *stream = fdopen(connection, "r");
 
-        for (int j = 0; j < numberOfSerialNumbers; j += 1) {
+    if (stream == NULL) {
 
-            if (i != j && strncmp(parsedSerialNumbers[i], parsedSerialNumbers[j], USB_SERIAL_NUMBER_LENGTH) == 0) {
+        close(connection);
 
-                puts("[ERROR] Repeated device ID.");
+        return false;
 
-                return ERROR_RESPONSE; 
+    }
 
-            }
+    char line[COMMAND_LINE_SIZE];
+
+    bool finished = false;
+
+    while (fgets(line, COMMAND_LINE_SIZE, stream) != NULL) {
+
+        if (line[0] == DAEMON_STATUS_MARKER) {
+
+            *response = atoi(line + 1);
+
+            finished = true;
+
+            break;
 
         }
 
+        fputs(line, stdout);
+
     }
 
-    /* Access enumerated devices */
-    
-    struct hid_device_info *deviceInfo = hid_enumerate(AUDIOMOTH_USB_VID, AUDIOMOTH_USB_PID);
-    
-    /* Perform the requested action */
+    fclose(stream);
 
-    char *operationStrings[] = {"CONFIG", "UPDATE", "LED", "RESTORE", "READ", "PERSIST", "FIRMWARE", "BOOTLOADER"};
+    if (finished == false) {
 
-    if (operationType == LIST_OP) {
+        puts("[ERROR] Lost connection to daemon.");
 
-        /* List enumerated AudioMoth USB Microphone */
+        *response = ERROR_RESPONSE;
 
-        while (deviceInfo != NULL) {
-        
-            char *path = deviceInfo->path;
-            
-            if (path != NULL) {
-        
-                bool success = convertToNarrow(deviceInfo->serial_number, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-            
-                if (success == false) {
-            
-                    hid_device *device = hid_open_path(path);
+    }
 
-                    if (device != NULL) {
-               
-                        int error = hid_get_serial_number_string(device, currentWideSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-                   
-                        if (error == false) {
-                       
-                            success = convertToNarrow(currentWideSerialNumber, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-                       
-                        }
-               
-                    }
-               
-                }
-        
-                if (success) {
-            
-                    char *currentSerialNumberPtr = strstr(currentSerialNumber, "_") + 1;
-        
-                    if (currentSerialNumberPtr == currentSerialNumber + USB_SERIAL_NUMBER_OFFSET && strlen(currentSerialNumberPtr) == USB_SERIAL_NUMBER_LENGTH) {
+    return true;
 
-                        int j = 0;
-            
-                        bool digit = false;
-                        
-                        char frequencyString[] = {0, 0, 0, 0};
-            
-                        for (int i = 0; i < USB_SERIAL_NUMBER_OFFSET - 1; i += 1) {
-                    
-                            if (digit || currentSerialNumber[i] > '0') {
-                        
-                                frequencyString[j++] = currentSerialNumber[i];
+}
 
-                                digit = true;
+/* Function to run one request from a daemon client, with the command output sent to the client */
 
-                            }
+static void handleRequest(int connection) {
 
-                        }
+    /* Give up on clients which do not send a whole request */
 
-                        printf("%s - %skHz AudioMoth USB Microphone\n", currentSerialNumberPtr, frequencyString);
-                            
-                    }
-                        
-                } else {
+    struct timeval timeout = {DAEMON_REQUEST_TIMEOUT, 0};
 
-                    puts("[ERROR] Problem accessing USB device.");
-                    
-                    break;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-                }
-                
-            }
-            
-            deviceInfo = deviceInfo->next;
+    char request[COMMAND_LINE_SIZE];
 
-        }
+    int length = 0;
 
-    } else if (deviceInfo == NULL) {
-        
-        puts("[WARNING] No AudioMoth USB Microphones found.");
+    char *newline = NULL;
 
-    } else if (numberOfSerialNumbers == 0) {
+    while (newline == NULL && length < COMMAND_LINE_SIZE - 1) {
 
-        /* Send CONFIG, UPDATE, LED, RESTORE, READ, PERSIST, FIRMWARE or BOOTLOADER to all connected AudioMoth USB Microphone */
+        ssize_t received = read(connection, request + length, COMMAND_LINE_SIZE - 1 - length);
 
-        bool cancel = false;
+        if (received < 0 && errno == EINTR) continue;
 
-        while (deviceInfo != NULL && cancel == false) {
+        if (received <= 0) return;
 
-            char *path = deviceInfo->path;
-            
-            if (path != NULL) {
-        
-                bool success = convertToNarrow(deviceInfo->serial_number, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-            
-                if (success == false) {
-            
-                    hid_device *device = hid_open_path(path);
-
-                    if (device != NULL) {
-                   
-                        int error = hid_get_serial_number_string(device, currentWideSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-                           
-                        if (error == false) {
-                           
-                            success = convertToNarrow(currentWideSerialNumber, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-                           
-                        }
-                   
-                    }
-                   
-                    hid_close(device);
-               
-                }
-            
-                if (success) {
-                    
-                    char *currentSerialNumberPtr = strstr(currentSerialNumber, "_") + 1;
+        length += received;
 
-                    if (currentSerialNumberPtr == currentSerialNumber + USB_SERIAL_NUMBER_OFFSET && strlen(currentSerialNumberPtr) == USB_SERIAL_NUMBER_LENGTH) {
+        request[length] = '\0';
 
-                        bool completed = communicate(operationType, path);
+        newline = strchr(request, '\n');
 
-                        if (completed) {
+    }
 
-                            if (operationType == READ_OP) {
+    if (newline == NULL) return;
 
-                                printf("%s - ", currentSerialNumberPtr);
+    *newline = '\0';
 
-                                printConfiguration((configSettings_t*)(usbInputBuffer + 1));
+    /* Split the request into arguments */
 
-                            } else if (operationType == FIRMWARE_OP) {
-                                
-                                printf("%s - ", currentSerialNumberPtr);
-                                
-                                printf("%s (%d.%d.%d)\n", usbInputBuffer + 4, *((uint8_t*)usbInputBuffer + 1), *((uint8_t*)usbInputBuffer + 2), *((uint8_t*)usbInputBuffer + 3));
+    char *arguments[MAXIMUM_NUMBER_OF_ARGUMENTS];
 
-                            } else {
+    int numberOfArguments;
 
-                                char *operationString = operationStrings[operationType - 2];
+    bool split = splitArguments(request, arguments, &numberOfArguments);
 
-                                printf("Sent %s command to device ID %s.\n", operationString, currentSerialNumberPtr);
+    /* Run the command with standard output redirected to the client */
 
-                            }
+    fflush(stdout);
 
-                        } else {
-                            
-                            printf("[ERROR] Problem communicating with device ID %s.\n", currentSerialNumberPtr);
+    int savedStdout = dup(STDOUT_FILENO);
 
-                        }
+    if (savedStdout < 0) return;
 
-                    }
-                    
-                } else {
+    dup2(connection, STDOUT_FILENO);
 
-                    puts("[ERROR] Problem accessing USB device.");
+    int response = ERROR_RESPONSE;
 
-                    cancel = true;
+    if (split) {
 
-                }
-                
-            }
+        response = runCommand(numberOfArguments, arguments, false, NULL);
 
-            deviceInfo = deviceInfo->next;
+    } else {
 
-        }
+        puts("[ERROR] Could not parse arguments.");
 
-    } else {
+    }
 
-        /* Send CONFIG, UPDATE, LED, RESTORE, READ, PERSIST, FIRMWARE or BOOTLOADER to AudioMoth USB Microphone specified by serial number */
+    printf("%c%d\n", DAEMON_STATUS_MARKER, response);
 
-        bool cancel = false;
+    fflush(stdout);
 
-        struct hid_device_info *firstDeviceInfo = deviceInfo;
+    dup2(savedStdout, STDOUT_FILENO);
 
-        for (int i = 0; i < numberOfSerialNumbers; i += 1) {
+    close(savedStdout);
 
-            bool found = false;
+}
 
-            deviceInfo = firstDeviceInfo;
+/* Daemon stop flag and signal handler */
 
-            while (deviceInfo != NULL && cancel == false) {
-            
-                char *path = deviceInfo->path;
-            
-                if (path != NULL) {
-        
-                    bool success = convertToNarrow(deviceInfo->serial_number, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-            
-                    if (success == false) {
-            
-                        hid_device *device = hid_open_path(path);
-
-                        if (device != NULL) {
-                   
-                            int error = hid_get_serial_number_string(device, currentWideSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-                       
-                            if (error == false) {
-                       
-                                success = convertToNarrow(currentWideSerialNumber, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
-                       
-                            }
-           
-                        }
-               
-                        hid_close(device);
-               
-                    }
+static volatile sig_atomic_t daemonStopping = 0;
 
-                    if (success) {
+static void stopDaemon(int signalNumber) {
 
-                        convertToNarrow(deviceInfo->serial_number, currentSerialNumber, SERIAL_NUMBER_BUFFER_SIZE);
+    daemonStopping = 1;
 
-                        char *currentSerialNumberPtr = strstr(currentSerialNumber, "_") + 1;
+}
 
-                        if (currentSerialNumberPtr == currentSerialNumber + USB_SERIAL_NUMBER_OFFSET && strlen(currentSerialNumberPtr) == USB_SERIAL_NUMBER_LENGTH && strncmp(currentSerialNumberPtr, parsedSerialNumbers[i], USB_SERIAL_NUMBER_LENGTH) == 0) {
+#ifdef HIDAPI_LIBUSB
 
-                            bool completed = communicate(operationType, path);
+/* Function to drop the handle kept open for a device when it is unplugged */
 
-                            if (completed) {
+static void deviceChanged(const struct hid_device_info *info, int attached, void *userData) {
 
-                                if (operationType == READ_OP) {
+    if (attached == false) hid_release_claimed(info->path);
 
-                                    printf("%s - ", currentSerialNumberPtr);
+}
 
-                                    printConfiguration((configSettings_t*)(usbInputBuffer + 1));
+#endif
 
-                                } else if (operationType == FIRMWARE_OP) {
-                                
-                                    printf("%s - ", currentSerialNumberPtr);
-                                
-                                    printf("%s (%d.%d.%d)\n", usbInputBuffer + 4, *((uint8_t*)usbInputBuffer + 1), *((uint8_t*)usbInputBuffer + 2), *((uint8_t*)usbInputBuffer + 3));
+/* Function to serve commands over the daemon socket until interrupted */
 
-                                } else {
+static int runDaemon(void) {
 
-                                    char *operationString = operationStrings[operationType - 2];
-                                
-                                    printf("Sent %s command to device ID %s.\n", operationString, currentSerialNumberPtr);
+    struct sockaddr_un address;
 
-                                }
+    if (getSocketAddress(&address) == false) {
 
-                            } else {
-                                
-                                printf("[ERROR] Problem communicating with device ID %s.\n", currentSerialNumberPtr);
+        puts("[ERROR] Daemon socket path is too long.");
 
-                            }
+        return ERROR_RESPONSE;
 
-                            found = true;
+    }
 
-                        }
+    /* Refuse to start twice, and remove a socket left by a daemon which did not stop cleanly */
 
-                    } else {
+    int connection = connectToDaemon();
 
-                        puts("[ERROR] Problem accessing USB device.");
+    if (connection >= 0) {
 
-                        cancel = true;
-                    
+        close(connection);
 
-                    }
+        puts("[ERROR] Daemon is already running.");
 
-                }
+        return ERROR_RESPONSE;
 
-                deviceInfo = deviceInfo->next;
+    }
 
-            }
+    /* Only remove an old socket which belongs to this user */
+
+    struct stat status;
+
+    if (lstat(address.sun_path, &status) == 0) {
+
+        if (S_ISSOCK(status.st_mode) == false || status.st_uid != getuid()) {
+
+            printf("[ERROR] %s is not a daemon socket owned by this user.\n", address.sun_path);
+
+            return ERROR_RESPONSE;
+
+        }
+
+        unlink(address.sun_path);
+
+    }
 
-            if (cancel) break;
+    /* Create the socket so only this user can connect */
 
-            if (found == false) printf("[ERROR] Could not find device ID %s.\n", parsedSerialNumbers[i]);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    mode_t mask = umask(0077);
+
+    bool listening = listener >= 0 && bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0 && listen(listener, DAEMON_BACKLOG) == 0;
+
+    umask(mask);
+
+    if (listening == false) {
+
+        puts("[ERROR] Could not create daemon socket.");
+
+        if (listener >= 0) close(listener);
+
+        return ERROR_RESPONSE;
+
+    }
+
+    /* Stop on SIGINT or SIGTERM, and ignore clients which disconnect early */
+
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+
+    action.sa_handler = stopDaemon;
+
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGINT, &action, NULL);
+
+    sigaction(SIGTERM, &action, NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+
+#ifdef HIDAPI_LIBUSB
+
+    /* Keep the list of devices up to date from hotplug events rather than scanning the bus for every command */
+
+    hid_registry_start(AUDIOMOTH_USB_VID, AUDIOMOTH_USB_PID, deviceChanged, NULL);
+
+#endif
+
+    printf("Daemon listening on %s.\n", address.sun_path);
+
+    fflush(stdout);
+
+    while (daemonStopping == 0) {
+
+        connection = accept(listener, NULL, NULL);
+
+        if (connection < 0) {
+
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            puts("[ERROR] Could not accept daemon connection.");
+
+            break;
 
         }
 
+        if (peerIsThisUser(connection)) handleRequest(connection);
+
+        close(connection);
+
     }
 
+    close(listener);
+
+    unlink(address.sun_path);
+
+    hid_exit();
+
     return OKAY_RESPONSE;
 
 }
+
+#endif
+
+/* Main function */
+
+int main(int argc, char **argv) {
+
+    int response;
+
+    /* Display version number */
+
+    puts("AudioMoth-USB-Microphone 1.0.1");
+
+    bool batch = argc > 1 && parseArgument("BATCH", argv[1]);
+
+#ifdef DAEMON_SUPPORTED
+
+    /* Run as the daemon, or let a running daemon handle the command */
+
+    if (argc > 1 && parseArgument("DAEMON", argv[1])) return runDaemon();
+
+    if (argc > 1 && batch == false && forwardCommand(argc, argv, &response)) return response;
+
+#endif
+
+    /* Run a batch of commands or a single command in this process */
+
+    if (batch) {
+
+        response = runBatch(argc, argv);
+
+    } else {
+
+        response = runCommand(argc, argv, false, NULL);
+
+    }
+
+    /* Release the devices kept claimed between commands so that their kernel drivers are attached again */
+
+    hid_exit();
+
+    return response;
+
+}